@@ -1,8 +1,10 @@
 #ifndef USNG_ADPCM_H
 #define USNG_ADPCM_H
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
 class Adpcm {
@@ -46,8 +48,27 @@ class Adpcm {
 
 	unsigned int chunkFrames() const { return m_interleave / 16 * 28; }
 	unsigned int chunkBytes() const { return m_interleave * 2; }
+	unsigned int channels() const { return headers.size(); }
+	unsigned int interleave() const { return m_interleave; }
 	void interleave(unsigned int _interleave) {m_interleave = _interleave; }
 
+	/** Predictor history (prev1, prev2 for each channel), the only state carried across chunks. **/
+	std::vector<short> history() const {
+		std::vector<short> ret;
+		for (unsigned ch = 0; ch < headers.size(); ++ch) {
+			ret.push_back(headers[ch].prev1);
+			ret.push_back(headers[ch].prev2);
+		}
+		return ret;
+	}
+	/** Restore predictor history; channels missing from hist are reset to silence. **/
+	void history(std::vector<short> const& hist) {
+		for (unsigned ch = 0; ch < headers.size(); ++ch) {
+			headers[ch].prev1 = (2 * ch + 1 < hist.size() ? hist[2 * ch] : 0);
+			headers[ch].prev2 = (2 * ch + 1 < hist.size() ? hist[2 * ch + 1] : 0);
+		}
+	}
+
 	/** Decode chunkBytes() bytes, outputting chunkFrames() samples/ch. **/
 	template <typename OutIt> OutIt decodeChunk(char const* data, OutIt pcm) {
 		for (unsigned pos = 0; pos < m_interleave; pos += 16) pcm = decodeBlock(data + pos, pcm);
@@ -80,4 +101,106 @@ class Adpcm {
 	std::vector<Header> headers;
 };
 
+/** Seek index for ADPCM streams.
+* Prediction makes every sample depend on all the previous ones, so decoding normally has to
+* start from the beginning. The index stores the predictor history at every chunk boundary,
+* allowing decoding to be started at any chunk. It is built in one pass by calling add() before
+* each chunk is decoded.
+**/
+class AdpcmIndex {
+  public:
+	struct Entry {
+		unsigned int offset;  ///< Byte offset of the chunk in the stream
+		unsigned int interleave;  ///< Interleave in effect for the chunk
+		unsigned int frame;  ///< First PCM frame decoded from the chunk
+		std::vector<short> history;  ///< Adpcm::history() before decoding the chunk
+	};
+	typedef std::vector<Entry> entries_t;
+
+	void add(Adpcm const& adpcm, unsigned int offset, unsigned int frame) {
+		Entry e;
+		e.offset = offset;
+		e.interleave = adpcm.interleave();
+		e.frame = frame;
+		e.history = adpcm.history();
+		m_entries.push_back(e);
+	}
+	entries_t const& entries() const { return m_entries; }
+	bool empty() const { return m_entries.empty(); }
+
+	/** Find the last chunk starting at or before the given PCM frame. **/
+	Entry const& find(unsigned int frame) const {
+		if (m_entries.empty()) throw std::logic_error("ADPCM index is empty");
+		entries_t::const_iterator it = m_entries.begin() + 1;
+		while (it != m_entries.end() && it->frame <= frame) ++it;
+		return *--it;
+	}
+
+	/** Prepare the decoder for decoding the chunk of the given entry. **/
+	void seek(Adpcm& adpcm, Entry const& e) const {
+		adpcm.interleave(e.interleave);
+		adpcm.history(e.history);
+	}
+
+	void write(std::ostream& os) const {
+		os.write("SSAI", 4);
+		putLE(os, 1);  // Version
+		putLE(os, m_entries.size());
+		for (entries_t::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+			putLE(os, it->offset);
+			putLE(os, it->interleave);
+			putLE(os, it->frame);
+			putLE(os, it->history.size());
+			for (unsigned i = 0; i < it->history.size(); ++i) putLE(os, static_cast<unsigned short>(it->history[i]), 2);
+		}
+	}
+
+	/** Read an index written by write(), checking that it belongs to the stream of streamSize bytes decoded by adpcm. **/
+	void read(std::istream& is, Adpcm const& adpcm, unsigned int streamSize) {
+		char magic[4];
+		is.read(magic, 4);
+		if (!is || std::string(magic, 4) != "SSAI" || getLE(is) != 1) throw std::runtime_error("Not a valid ADPCM index");
+		// The count is not trusted for allocating: entries are added only as they are read
+		unsigned int count = getLE(is);
+		entries_t entries;
+		entries.reserve(std::min(count, 1u << 16));
+		for (unsigned int n = 0; is && n < count; ++n) {
+			Entry e;
+			e.offset = getLE(is);
+			e.interleave = getLE(is);
+			e.frame = getLE(is);
+			unsigned int historySize = getLE(is);
+			if (!is) break;
+			// Two samples per channel, the same for every chunk
+			if (historySize % 2 || historySize > 2 * maxChannels || (!entries.empty() && historySize != entries[0].history.size())) throw std::runtime_error("Not a valid ADPCM index");
+			e.history.resize(historySize);
+			for (unsigned i = 0; i < e.history.size(); ++i) e.history[i] = static_cast<short>(getLE(is, 2));
+			entries.push_back(e);
+		}
+		if (!is) throw std::runtime_error("ADPCM index truncated");
+		// A stale index would otherwise seek to garbage. Chunks are of four channels from the start of the stream,
+		// of which the decoder may use fewer.
+		unsigned int stride = 2 * adpcm.chunkBytes();
+		for (entries_t::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+			if (it->interleave != adpcm.interleave() || it->history.size() < 2 * adpcm.channels() || it->offset % stride
+			  || it->offset + stride > streamSize || it->frame != it->offset / stride * adpcm.chunkFrames()) {
+				throw std::runtime_error("ADPCM index does not match the stream");
+			}
+		}
+		m_entries.swap(entries);
+	}
+
+  private:
+	static const unsigned int maxChannels = 16;  ///< Sanity limit for reading
+	static void putLE(std::ostream& os, unsigned int val, unsigned bytes = 4) {
+		for (unsigned i = 0; i < bytes; ++i) os.put(static_cast<char>(val >> i * 8));
+	}
+	static unsigned int getLE(std::istream& is, unsigned bytes = 4) {
+		unsigned int val = 0;
+		for (unsigned i = 0; i < bytes; ++i) val |= static_cast<unsigned char>(is.get()) << i * 8;
+		return val;
+	}
+	entries_t m_entries;
+};
+
 #endif
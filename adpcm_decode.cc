@@ -1,18 +1,14 @@
 #include "adpcm.h"
 #include "pak.h"
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 unsigned short decode_channels = 2;
 
-void process(Adpcm& adpcm, std::vector<char> const& data, std::ostream& outfile) {
-	std::vector<short> pcm(adpcm.chunkFrames() * decode_channels);
-	adpcm.decodeChunk(&data[0], &pcm[0]);
-	outfile.write(reinterpret_cast<char*>(&pcm[0]), pcm.size() * sizeof(short));
-}
-
 void writeWavHeader(std::ostream& outfile, unsigned ch, unsigned sr, unsigned samples) {
 	unsigned bps = ch * 2; // Bytes per sample
 	unsigned datasize = bps * samples;
@@ -32,17 +28,27 @@ void writeWavHeader(std::ostream& outfile, unsigned ch, unsigned sr, unsigned sa
 }
 
 int main(int argc, char** argv) {
-	std::string in, out, pak;
+	std::string in, out, pak, indexfile;
+	double start = 0.0, duration = 0.0;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--index" && i + 1 < argc) indexfile = argv[++i];
+		else if (arg == "--start" && i + 1 < argc) start = std::atof(argv[++i]);
+		else if (arg == "--duration" && i + 1 < argc) duration = std::atof(argv[++i]);
+		else args.push_back(arg);
+	}
 
-	if( argc == 3 ) {
-		in = argv[1];
-		out = argv[2];
-	} else if( argc == 4 ) {
-		pak = argv[1];
-		in = argv[2];
-		out = argv[3];
+	if( args.size() == 2 ) {
+		in = args[0];
+		out = args[1];
+	} else if( args.size() == 3 ) {
+		pak = args[0];
+		in = args[1];
+		out = args[2];
 	} else {
-		std::cout << "Usage: " << argv[0] << " [archive.pak] input.mib output.wav" << std::endl;
+		std::cout << "Usage: " << argv[0] << " [--index file.idx] [--start sec] [--duration sec] [archive.pak] input.mib output.wav" << std::endl;
+		std::cout << "The index file is created if it does not exist and used for seeking if it does." << std::endl;
 		return EXIT_FAILURE;
 	}
 	// FIXME: read from music.mih
@@ -53,20 +59,59 @@ int main(int argc, char** argv) {
 	if (out != "-") outf.open(out.c_str(), std::ios::binary);
 	std::ostream& outfile = (out != "-" ? outf : std::cout);
 	std::vector<char> data(adpcm.chunkBytes());
+	// Each chunk holds 4 channels, of which only the first two are decoded
+	const unsigned stride = 2 * adpcm.chunkBytes();
+	std::ifstream infile;
+	std::unique_ptr<Pak> p;
+	PakFile const* pakfile = NULL;
+	unsigned size;
 	if (pak.empty()) {
-		std::ifstream infile(in.c_str(), std::ios::binary);
-		writeWavHeader(outfile, 2, sr, sr * 1000 /* FIXME: calculate real length */);
-		while (infile.read(&data[0], adpcm.chunkBytes()) && infile.seekg(adpcm.chunkBytes(), std::ios::cur)) {
-			process(adpcm, data, outfile);
-		}
+		infile.open(in.c_str(), std::ios::binary);
+		if (!infile) { std::cerr << "Could not open " << in << std::endl; return EXIT_FAILURE; }
+		infile.seekg(0, std::ios::end);
+		size = infile.tellg();
 	} else {
-		Pak p(pak);
-		PakFile const& infile(p[in]);
-		writeWavHeader(outfile, 2, sr, infile.size / (adpcm.chunkBytes() * 2) * adpcm.chunkFrames());
-		for (unsigned pos = 0, end; (end = pos + 2 * adpcm.chunkBytes()) <= infile.size; pos = end) {
-			infile.get(data, pos, end - pos);
-			process(adpcm, data, outfile);
+		p.reset(new Pak(pak));
+		pakfile = &(*p)[in];
+		size = pakfile->size;
+	}
+	AdpcmIndex index;
+	bool buildIndex = false;
+	if (!indexfile.empty()) {
+		std::ifstream f(indexfile.c_str(), std::ios::binary);
+		if (!f) {
+			buildIndex = true;
+		} else try {
+			index.read(f, adpcm, size);
+		} catch (std::exception& e) {
+			std::cerr << indexfile << ": " << e.what() << std::endl;
+			return EXIT_FAILURE;
 		}
 	}
+	unsigned totalFrames = size / stride * adpcm.chunkFrames();
+	unsigned first = std::min<unsigned>(start * sr, totalFrames);
+	unsigned last = (duration > 0.0 ? std::min<unsigned>(first + duration * sr, totalFrames) : totalFrames);
+	unsigned frame = 0, pos = 0;
+	if (!buildIndex && !index.empty()) {
+		AdpcmIndex::Entry const& e = index.find(first);
+		index.seek(adpcm, e);
+		frame = e.frame;
+		pos = e.offset;
+	}
+	writeWavHeader(outfile, 2, sr, last - first);
+	std::vector<short> pcm(adpcm.chunkFrames() * decode_channels);
+	// Without an index to build, there is no need to decode past the requested window
+	for (unsigned end; (end = pos + stride) <= size && (buildIndex || frame < last); pos = end, frame += adpcm.chunkFrames()) {
+		if (pakfile) pakfile->get(data, pos, data.size());
+		else if (!infile.seekg(pos).read(&data[0], data.size())) break;
+		if (buildIndex) index.add(adpcm, pos, frame);
+		adpcm.decodeChunk(&data[0], &pcm[0]);
+		// Output only the part of the chunk that falls within the window
+		unsigned b = std::max(first, frame), e = std::min(last, frame + adpcm.chunkFrames());
+		if (b < e) outfile.write(reinterpret_cast<char*>(&pcm[(b - frame) * decode_channels]), (e - b) * decode_channels * sizeof(short));
+	}
+	if (buildIndex) {
+		std::ofstream f(indexfile.c_str(), std::ios::binary);
+		index.write(f);
+	}
 }
-
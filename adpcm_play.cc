@@ -1,50 +1,204 @@
 #include "adpcm.h"
+#include "config.hh"
+#include "pak.h"
+#include "ringbuffer.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_PORTAUDIO
 #include <portaudio.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// FIXME: read from music.mih
+const unsigned sr = 48000;
+const unsigned interleave = 0xB800;
+const unsigned channels = 2;
+
+/** Shared state between the decoder thread and the audio callback. **/
+struct Player {
+	RingBuffer<int16_t> ring;
+	std::atomic<bool> finished;  // Decoder has pushed everything
+	std::atomic<bool> quit;
+	// Statistics, only written by the callback
+	std::atomic<unsigned> callbacks, underruns;
+	std::atomic<unsigned> minFill, maxFill;
+	std::atomic<unsigned long long> sumFill;
+	std::atomic<long long> firstAudio;  // Microseconds from start to the first callback with audio, -1 if none yet
+	Clock::time_point start;
+	Player(unsigned frames): ring(frames * channels), finished(), quit(), callbacks(), underruns(), minFill(~0u), maxFill(), sumFill(), firstAudio(-1), start(Clock::now()) {}
 
-static int c_callback(void*, void* output, unsigned long framesPerBuffer, PaTimestamp, void* userdata) {
-	AudioFifo* audioQueue = static_cast<AudioFifo*>(userdata);
-	unsigned long size = 0;
-	unsigned char channels = 2;
-	std::vector<int16_t> buf;
-	while(size < framesPerBuffer*channels) {
-		size+=audioQueue->tryPop(buf, framesPerBuffer*channels-size);
+	/** Fill output with frames of audio. Real-time safe: no locks, allocations or I/O. **/
+	void callback(int16_t* output, unsigned long frames) {
+		unsigned fill = ring.size() / channels;
+		std::size_t samples = frames * channels;
+		std::size_t got = ring.read(output, samples);
+		std::fill(output + got, output + samples, 0);
+		if (got < samples && !finished) underruns.store(underruns + 1, std::memory_order_relaxed);
+		if (got && firstAudio < 0) firstAudio = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+		callbacks.store(callbacks + 1, std::memory_order_relaxed);
+		minFill.store(std::min<unsigned>(minFill, fill), std::memory_order_relaxed);
+		maxFill.store(std::max<unsigned>(maxFill, fill), std::memory_order_relaxed);
+		sumFill.store(sumFill + fill, std::memory_order_relaxed);
 	}
-	int16_t* my_out = (int16_t*)output;
-	for( unsigned int i = 0 ; i < size ; i++ ) {
-		my_out[i] = buf[i];
+	bool done() const { return finished && ring.size() == 0; }
+};
+
+/** Decode the stream from the given PCM frame on, blocking while the ring buffer is full. **/
+void decode(Player& player, PakFile const& file, AdpcmIndex const& index, unsigned startFrame) {
+	Adpcm adpcm(interleave, channels);
+	// Each chunk holds 4 channels, of which only the first two are decoded
+	const unsigned stride = 2 * adpcm.chunkBytes();
+	unsigned pos = 0, frame = 0;
+	if (!index.empty()) {
+		AdpcmIndex::Entry const& e = index.find(startFrame);
+		index.seek(adpcm, e);
+		pos = e.offset;
+		frame = e.frame;
+	}
+	PakReader reader(file, pos);
+	std::vector<char> data(stride);
+	std::vector<int16_t> pcm(adpcm.chunkFrames() * channels);
+	for (; pos + stride <= reader.size() && !player.quit; pos += stride, frame += adpcm.chunkFrames()) {
+		reader.read(&data[0], stride);
+		adpcm.decodeChunk(&data[0], &pcm[0]);
+		// Without an index, chunks before the start are decoded only for their predictor history
+		unsigned skip = std::min(adpcm.chunkFrames(), startFrame > frame ? startFrame - frame : 0);
+		for (std::size_t i = skip * channels; i < pcm.size() && !player.quit; ) {
+			i += player.ring.write(&pcm[i], pcm.size() - i);
+			if (i < pcm.size()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
 	}
-	return 0;
+	player.finished = true;
 }
 
-int main( int argc, char** argv) {
-	std::ifstream m_f1;
-	std::string in, out, fat;
-
-	if( argc == 2 ) {
-		fat = "none";
-		in = argv[1];
-	} else if( argc == 3 ) {
-		fat = argv[1];
-		in = argv[2];
-	} else {
-		std::cout << "Usage: " << argv[0] << " [fat_file] input_file" << std::endl;
-		return EXIT_FAILURE;
+/** Headless sink calling the callback at the pace of a real device, optionally saving the output. **/
+void runClockSink(Player& player, unsigned long frames, std::string const& filename) {
+	std::ofstream out;
+	if (!filename.empty()) out.open(filename.c_str(), std::ios::binary);
+	std::vector<int16_t> buf(frames * channels);
+	Clock::duration period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(double(frames) / sr));
+	player.start = Clock::now();
+	for (Clock::time_point next = player.start; !player.done(); ) {
+		player.callback(&buf[0], frames);
+		if (out.is_open()) out.write(reinterpret_cast<char const*>(&buf[0]), buf.size() * sizeof(int16_t));
+		next += period;
+		std::this_thread::sleep_until(next);
 	}
+}
 
-	Adpcm file(in,fat);
-	PaError pa_err=Pa_Initialize();
-	PaStream *stream;
-	pa_err = Pa_OpenStream(&stream, paNoDevice, 0, paInt16, NULL, \
-			Pa_GetDefaultOutputDeviceID(), \
-			2, paInt16, NULL, 48000, 1234, 0, 0, \
-			c_callback, &file.audioQueue);
-	pa_err=Pa_StartStream(stream);
-	while( !file.finished() || file.audioQueue.size() > 0) {
-		sleep(1);
+#ifdef HAVE_PORTAUDIO
+static int paCallback(void const*, void* output, unsigned long frames, PaStreamCallbackTimeInfo const*, PaStreamCallbackFlags, void* userdata) {
+	static_cast<Player*>(userdata)->callback(static_cast<int16_t*>(output), frames);
+	return paContinue;
+}
 
+void runPortAudio(Player& player, unsigned long frames) {
+	PaError err = Pa_Initialize();
+	if (err != paNoError) throw std::runtime_error(Pa_GetErrorText(err));
+	PaStream* stream;
+	err = Pa_OpenDefaultStream(&stream, 0, channels, paInt16, sr, frames, paCallback, &player);
+	if (err == paNoError) {
+		player.start = Clock::now();
+		err = Pa_StartStream(stream);
+		while (err == paNoError && !player.done()) Pa_Sleep(100);
+		Pa_StopStream(stream);
+		Pa_CloseStream(stream);
 	}
-	pa_err=Pa_CloseStream(stream);
-	pa_err=Pa_Terminate();
+	Pa_Terminate();
+	if (err != paNoError) throw std::runtime_error(Pa_GetErrorText(err));
+}
+#endif
 
+int main(int argc, char** argv) {
+#ifdef HAVE_PORTAUDIO
+	std::string sink = "portaudio";
+#else
+	std::string sink = "null";
+#endif
+	std::string in, pak, indexfile;
+	double start = 0.0, buffer = 0.2;
+	unsigned long frames = 256;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--sink" && i + 1 < argc) sink = argv[++i];
+		else if (arg == "--index" && i + 1 < argc) indexfile = argv[++i];
+		else if (arg == "--start" && i + 1 < argc) start = std::atof(argv[++i]);
+		else if (arg == "--buffer" && i + 1 < argc) buffer = std::atof(argv[++i]) / 1000.0;
+		else if (arg == "--frames" && i + 1 < argc) frames = std::atol(argv[++i]);
+		else args.push_back(arg);
+	}
+	if (args.size() == 1) {
+		in = args[0];
+	} else if (args.size() == 2) {
+		pak = args[0];
+		in = args[1];
+	} else {
+		std::cout << "Usage: " << argv[0] << " [options] [archive.pak] input.mib\n"
+		  "  --sink SINK      portaudio (default if available), null, or file:output.raw (headless, paced like a device)\n"
+		  "  --start SEC      start playback at the given time\n"
+		  "  --index FILE     ADPCM seek index (see ss_adpcm_decode) for starting without decoding from the beginning\n"
+		  "  --buffer MS      minimum ring buffer size in milliseconds (default 200, rounded up to a power of two)\n"
+		  "  --frames N       frames per audio callback (default 256)" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!frames) frames = 256;
+	try {
+		std::unique_ptr<Pak> p;
+		PakFile file(in);
+		if (pak.empty()) {
+			// Treat a plain file like a PAK containing only it
+			std::ifstream f(in.c_str(), std::ios::binary);
+			if (!f) throw std::runtime_error("Could not open " + in);
+			f.seekg(0, std::ios::end);
+			file.size = f.tellg();
+		} else {
+			p.reset(new Pak(pak));
+			file = (*p)[in];
+		}
+		AdpcmIndex index;
+		if (!indexfile.empty()) {
+			std::ifstream f(indexfile.c_str(), std::ios::binary);
+			if (!f) throw std::runtime_error("Could not open " + indexfile);
+			index.read(f, Adpcm(interleave, channels), file.size);
+		}
+		Player player(std::max<unsigned long>(sr * buffer, 2 * frames));
+		std::thread decoder(decode, std::ref(player), std::cref(file), std::cref(index), unsigned(start * sr));
+		// Let the decoder fill the buffer before starting playback
+		while (player.ring.size() < player.ring.capacity() / 2 && !player.finished) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		try {
+			if (sink == "null") runClockSink(player, frames, "");
+			else if (sink.substr(0, 5) == "file:") runClockSink(player, frames, sink.substr(5));
+#ifdef HAVE_PORTAUDIO
+			else if (sink == "portaudio") runPortAudio(player, frames);
+#endif
+			else throw std::runtime_error("Audio sink not available: " + sink);
+		} catch (...) {
+			player.quit = true;
+			decoder.join();
+			throw;
+		}
+		decoder.join();
+		unsigned callbacks = std::max(1u, unsigned(player.callbacks));
+		std::cerr << "Callbacks: " << player.callbacks << ", underruns: " << player.underruns << std::endl;
+		std::cerr << "Buffered latency (ms): min " << 1e3 * player.minFill / sr << ", avg " << 1e3 * player.sumFill / callbacks / sr
+		  << ", max " << 1e3 * player.maxFill / sr << std::endl;
+		std::cerr << "Time to first audio (ms): " << player.firstAudio / 1e3 << std::endl;
+	} catch (std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
 	return EXIT_SUCCESS;
 }
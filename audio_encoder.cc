@@ -0,0 +1,132 @@
+#include "audio_encoder.hh"
+#include "config.hh"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#ifdef HAVE_VORBIS
+#include <vorbis/vorbisenc.h>
+#endif
+#ifdef HAVE_LAME
+#include <lame/lame.h>
+#endif
+
+namespace {
+	const unsigned chunkFrames = 4096;  // PCM frames passed to the encoder at once
+}
+
+#ifdef HAVE_VORBIS
+namespace {
+	struct VorbisEncoder {
+		vorbis_info vi;
+		vorbis_comment vc;
+		vorbis_dsp_state vd;
+		vorbis_block vb;
+		ogg_stream_state os;
+		fs::ofstream& file;
+		VorbisEncoder(fs::ofstream& f, unsigned sr): file(f) {
+			vorbis_info_init(&vi);
+			if (vorbis_encode_init_vbr(&vi, 2, sr, 0.3f)) {
+				vorbis_info_clear(&vi);
+				throw std::runtime_error("Vorbis encoder does not support the sample rate");
+			}
+			vorbis_comment_init(&vc);
+			vorbis_comment_add_tag(&vc, "ENCODER", "ss_extract");
+			vorbis_analysis_init(&vd, &vi);
+			vorbis_block_init(&vd, &vb);
+			ogg_stream_init(&os, std::rand());
+			ogg_packet header, comments, codebooks;
+			vorbis_analysis_headerout(&vd, &vc, &header, &comments, &codebooks);
+			ogg_stream_packetin(&os, &header);
+			ogg_stream_packetin(&os, &comments);
+			ogg_stream_packetin(&os, &codebooks);
+			// Audio data must start on a new page
+			ogg_page og;
+			while (ogg_stream_flush(&os, &og)) writePage(og);
+		}
+		~VorbisEncoder() {
+			ogg_stream_clear(&os);
+			vorbis_block_clear(&vb);
+			vorbis_dsp_clear(&vd);
+			vorbis_comment_clear(&vc);
+			vorbis_info_clear(&vi);
+		}
+		void writePage(ogg_page const& og) {
+			file.write(reinterpret_cast<char const*>(og.header), og.header_len);
+			file.write(reinterpret_cast<char const*>(og.body), og.body_len);
+		}
+		/// Encode frames of interleaved stereo; zero frames finishes the stream.
+		void encode(short const* pcm, unsigned frames) {
+			if (frames) {
+				float** buf = vorbis_analysis_buffer(&vd, frames);
+				for (unsigned i = 0; i < frames; ++i) {
+					buf[0][i] = pcm[2 * i] / 32768.0f;
+					buf[1][i] = pcm[2 * i + 1] / 32768.0f;
+				}
+			}
+			vorbis_analysis_wrote(&vd, frames);
+			ogg_packet op;
+			ogg_page og;
+			while (vorbis_analysis_blockout(&vd, &vb) == 1) {
+				vorbis_analysis(&vb, NULL);
+				vorbis_bitrate_addblock(&vb);
+				while (vorbis_bitrate_flushpacket(&vd, &op)) {
+					ogg_stream_packetin(&os, &op);
+					while (ogg_stream_pageout(&os, &og)) writePage(og);
+				}
+			}
+			if (!frames) while (ogg_stream_flush(&os, &og)) writePage(og);
+		}
+	};
+}
+
+bool encodeVorbis(fs::path const& filename, std::vector<short> const& pcm, unsigned sr) {
+	fs::ofstream f(filename, std::ios::binary);
+	if (!f) throw std::runtime_error("Could not create " + filename.string());
+	VorbisEncoder enc(f, sr);
+	for (std::size_t pos = 0; pos < pcm.size(); pos += 2 * chunkFrames) {
+		enc.encode(&pcm[pos], std::min<std::size_t>(chunkFrames, (pcm.size() - pos) / 2));
+	}
+	enc.encode(NULL, 0);
+	if (!f) throw std::runtime_error("Writing " + filename.string() + " failed");
+	return true;
+}
+#else
+bool encodeVorbis(fs::path const&, std::vector<short> const&, unsigned) { return false; }
+#endif
+
+#ifdef HAVE_LAME
+bool encodeMp3(fs::path const& filename, std::vector<short> const& pcm, unsigned sr) {
+	struct Lame {
+		lame_global_flags* gf;
+		Lame(): gf(lame_init()) { if (!gf) throw std::runtime_error("lame_init failed"); }
+		~Lame() { lame_close(gf); }
+	} lame;
+	lame_set_in_samplerate(lame.gf, sr);
+	lame_set_num_channels(lame.gf, 2);
+	lame_set_quality(lame.gf, 0);
+	lame_set_VBR(lame.gf, vbr_off);
+	lame_set_brate(lame.gf, 256);
+	if (lame_init_params(lame.gf) < 0) throw std::runtime_error("Invalid LAME encoder parameters");
+	fs::ofstream f(filename, std::ios::binary);
+	if (!f) throw std::runtime_error("Could not create " + filename.string());
+	// Worst case output size as documented in lame.h
+	std::vector<unsigned char> mp3buf(5 * chunkFrames / 4 + 7200);
+	for (std::size_t pos = 0; pos < pcm.size(); pos += 2 * chunkFrames) {
+		int frames = std::min<std::size_t>(chunkFrames, (pcm.size() - pos) / 2);
+		int ret = lame_encode_buffer_interleaved(lame.gf, const_cast<short*>(&pcm[pos]), frames, &mp3buf[0], mp3buf.size());
+		if (ret < 0) throw std::runtime_error("LAME encoding failed");
+		f.write(reinterpret_cast<char const*>(&mp3buf[0]), ret);
+	}
+	int ret = lame_encode_flush(lame.gf, &mp3buf[0], mp3buf.size());
+	if (ret < 0) throw std::runtime_error("LAME encoding failed");
+	f.write(reinterpret_cast<char const*>(&mp3buf[0]), ret);
+	if (!f) throw std::runtime_error("Writing " + filename.string() + " failed");
+	return true;
+}
+#else
+bool encodeMp3(fs::path const&, std::vector<short> const&, unsigned) { return false; }
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <boost/filesystem/path.hpp>
+
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+// In-process audio encoders for interleaved 16-bit stereo PCM.
+// Each returns false without creating any file if support for the codec was not compiled in,
+// in which case the caller should fall back to writing WAV and using an external encoder.
+
+/// Encode into Ogg Vorbis (same quality as oggenc's default -q3)
+bool encodeVorbis(fs::path const& filename, std::vector<short> const& pcm, unsigned sr);
+/// Encode into MP3 (same settings as lame -q0 -b256)
+bool encodeMp3(fs::path const& filename, std::vector<short> const& pcm, unsigned sr);
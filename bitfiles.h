@@ -1,183 +1,259 @@
+#pragma once
+
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <vector>
 
+namespace bitfiles {
+	inline uint64_t loadBE64(char const* p) {
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		return v;
+	}
+	inline void storeBE64(char* p, uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		std::memcpy(p, &v, sizeof(v));
+	}
+}
+
+/** Big-endian bit writer that collects bits in a 64-bit register and writes the file in large blocks. **/
 class outBitFile {
   public:
-	outBitFile(const char* filename): outcnt(0), outfile(filename, std::ios::binary) {}
-	~outBitFile() { putbuf(); }
+	outBitFile(const char* filename): m_acc(), m_bits(), m_buf(BUFFER_SIZE), m_pos(), m_memory(false), outfile(filename, std::ios::binary) {}
+	/// Collect the output in memory, see data()
+	outBitFile(): m_acc(), m_bits(), m_buf(BUFFER_SIZE / 16), m_pos(), m_memory(true) {}
+	~outBitFile() {
+		if (m_memory) return;
+		align();
+		flush();
+	}
+
+	/// Output written to memory so far, padded to a byte boundary
+	std::vector<char> data() {
+		align();
+		return std::vector<char>(m_buf.begin(), m_buf.begin() + m_pos);
+	}
+
+	/// Discard the output collected in memory
+	void clear() {
+		m_acc = 0;
+		m_bits = 0;
+		m_pos = 0;
+	}
 
+	/// Append whole bytes, padding the output to a byte boundary first
+	void putbytes(char const* data, std::size_t size) {
+		align();
+		if (m_memory) {
+			m_buf.resize(m_pos);
+			m_buf.insert(m_buf.end(), data, data + size);
+			m_pos = m_buf.size();
+		} else {
+			flush();
+			outfile.write(data, size);
+		}
+	}
+
+	/// Write the n (at most 32) lowest bits of data
 	void putbits(unsigned int data, unsigned int n) {
-		unsigned int mask = 1 << (n-1);
-		for( unsigned int i = 0 ; i < n; i++) {
-			outbuf <<= 1;
-			if (data & mask) outbuf |= 1;
-			mask >>= 1;
-			outcnt++;
-			if (outcnt == 8) {
-				outfile.put(outbuf);
-				outcnt = 0;
-			}
+		if (n < 32) data &= (1u << n) - 1;
+		if (m_bits + n <= 64) {
+			m_acc = m_acc << n | data;
+			m_bits += n;
+			return;
 		}
+		// Fill the register up, emit it as a whole word and keep the remaining bits
+		unsigned int rest = m_bits + n - 64;
+		m_acc = m_acc << (n - rest) | uint64_t(data) >> rest;
+		if (m_pos + 8 > m_buf.size()) flush();
+		bitfiles::storeBE64(&m_buf[m_pos], m_acc);
+		m_pos += 8;
+		m_acc = data;  // Bits above rest are ignored by the next word
+		m_bits = rest;
 	}
 
+	/// Pad with zero bits to the next byte boundary
 	void putbuf() {
-		if (outcnt > 0) putbits(0, 8-outcnt);
+		if (m_bits % 8) putbits(0, 8 - m_bits % 8);
 	}
 
 	void put_dcs_y(int len) {
-		switch (len) {
-			case 0: putbits(4,3); break;
-			case 1: putbits(0,2); break;
-			case 2: putbits(1,2); break;
-			case 3: putbits(5,3); break;
-			case 4: putbits(6,3); break;
-			case 5: putbits(14,4); break;
-			case 6: putbits(30,5); break;
-			case 7: putbits(62,6); break;
-			case 8: putbits(126,7); break;
-			case 9: putbits(254,8); break;
-			case 10: putbits(510,9); break;
-			case 11: putbits(511,9); break;
-		}
+		static const Code codes[12] = {
+			{ 4, 3 }, { 0, 2 }, { 1, 2 }, { 5, 3 }, { 6, 3 }, { 14, 4 },
+			{ 30, 5 }, { 62, 6 }, { 126, 7 }, { 254, 8 }, { 510, 9 }, { 511, 9 }
+		};
+		if (len >= 0 && len < 12) putbits(codes[len].code, codes[len].len);
 	}
 
 	void put_dcs_c(int len) {
-		switch (len) {
-			case 0: putbits(0,2); break;
-			case 1: putbits(1,2); break;
-			case 2: putbits(2,2); break;
-			case 3: putbits(6,3); break;
-			case 4: putbits(14,4); break;
-			case 5: putbits(30,5); break;
-			case 6: putbits(62,6); break;
-			case 7: putbits(126,7); break;
-			case 8: putbits(254,8); break;
-			case 9: putbits(510,9); break;
-			case 10: putbits(1022,10); break;
-			case 11: putbits(1023,10); break;
-		}
+		static const Code codes[12] = {
+			{ 0, 2 }, { 1, 2 }, { 2, 2 }, { 6, 3 }, { 14, 4 }, { 30, 5 },
+			{ 62, 6 }, { 126, 7 }, { 254, 8 }, { 510, 9 }, { 1022, 10 }, { 1023, 10 }
+		};
+		if (len >= 0 && len < 12) putbits(codes[len].code, codes[len].len);
 	}
 
   private:
-	int outcnt;
+	static const std::size_t BUFFER_SIZE = 1 << 20;
+	struct Code { unsigned short code, len; };
+	/// Pad to a byte boundary and move the register contents into the buffer
+	void align() {
+		putbuf();
+		if (m_pos + 8 > m_buf.size()) flush();
+		for (; m_bits > 0; m_bits -= 8) m_buf[m_pos++] = m_acc >> (m_bits - 8);
+	}
+	/// Make room in the buffer: write it to the file, or grow it in memory
+	void flush() {
+		if (m_memory) {
+			m_buf.resize(std::max<std::size_t>(2 * m_buf.size(), 8));
+			return;
+		}
+		outfile.write(&m_buf[0], m_pos);
+		m_pos = 0;
+	}
+	uint64_t m_acc;  // Right aligned, the last m_bits are pending output
+	unsigned int m_bits;
+	std::vector<char> m_buf;
+	std::size_t m_pos;
+	bool m_memory;
 	std::ofstream outfile;
-	unsigned char outbuf;
-	std::vector<char> outdata;
 };
 
-#define BUFFER_SIZE 4096
-#define START_CODE 0x000001
-#define BYTE_ALIGN 0x80
-#define BYTE_START 0x80
-
+/** Big-endian bit reader with a 64-bit cache that is refilled on demand. **/
 class inBitFile {
   public:
-	inBitFile(std::vector<char> const& data): indata(data) {
-		wdMask = BYTE_START;
-		wdIndex = 0;
-	}
+	inBitFile(std::vector<char> const& data): indata(data), m_cache(), m_bits(), m_next() { refill(); }
 
 	void setpos(long int byte, unsigned int bit) {
-		wdIndex = byte;
-		wdMask = BYTE_START;
-		get(bit);
+		m_next = std::min<std::size_t>(byte, indata.size());
+		m_cache = 0;
+		m_bits = 0;
+		refill();
+		skip(bit);
 	}
 
 	void getpos( long int *byte, unsigned int *bit) {
-		unsigned wdMaskSave = wdMask;
-		unsigned count;
-		for(count = 0; wdMaskSave != 0x80; count++) wdMaskSave <<= 1;
-		*bit = count; // 0x80=0,0x40=1,0x20=2 usw
-		*byte = wdIndex;
+		std::size_t pos = tell();
+		*byte = pos / 8;
+		*bit = pos % 8;
+	}
+
+	/// Current position in bits
+	std::size_t tell() const { return m_next * 8 - m_bits; }
+
+	/// Return the next num_bits (at most 32) without consuming them; zero padded at end of data.
+	unsigned int peek(unsigned int num_bits) {
+		if (m_bits < num_bits) refill();
+		return num_bits ? m_cache >> (64 - num_bits) : 0;
 	}
 
+	/// Consume num_bits (at most 32).
+	void skip(unsigned int num_bits) {
+		if (m_bits < num_bits) refill();
+		if (num_bits > m_bits) num_bits = m_bits;  // End of data
+		m_cache = num_bits < 64 ? m_cache << num_bits : 0;
+		m_bits -= num_bits;
+	}
+
+	/// Read num_bits (at most 32). Returns 0 (and consumes the rest of the data) if there are not enough bits left.
 	int get(int num_bits) {
-		unsigned int buf;
-		if (!get_bits(&buf, num_bits)) return 0;
-		return buf;
+		if (m_bits < unsigned(num_bits)) {
+			refill();
+			if (m_bits < unsigned(num_bits)) { skip(m_bits); return 0; }
+		}
+		unsigned int ret = peek(num_bits);
+		skip(num_bits);
+		return ret;
 	}
 
+	/// Return num_bits (1 to 32) at bit position pos, independent of the read position; zero padded at end of data.
+	unsigned int bitsAt(std::size_t pos, unsigned int num_bits) const {
+		std::size_t byte = pos / 8;
+		uint64_t w = 0;
+		if (byte + 8 <= indata.size()) w = bitfiles::loadBE64(&indata[byte]);
+		else for (unsigned int i = 0; byte + i < indata.size(); ++i) w |= uint64_t(static_cast<unsigned char>(indata[byte + i])) << (56 - 8 * i);
+		return (w << pos % 8) >> (64 - num_bits);
+	}
+
+	/// Copy num_bits starting at bit position pos to out.
+	void copy(outBitFile& out, std::size_t pos, std::size_t num_bits) const {
+		for (; num_bits >= 32; pos += 32, num_bits -= 32) out.putbits(bitsAt(pos, 32), 32);
+		if (num_bits) out.putbits(bitsAt(pos, num_bits), num_bits);
+	}
+
+	/// Skip to the next byte aligned start code (0x000001). Returns 0 if there is none.
 	int next_start_code() {
-		unsigned int buf;
-		/* locate next start code */
-		if (wdMask != BYTE_ALIGN) {
-			/* not byte aligned */
-			/* skip stuffed zero bits */
-			wdMask = BYTE_ALIGN;
-			wdIndex++;
-		}
-		if (!next_bits(&buf, 24)) return 0; /* end of bitstream */
-		while (buf != START_CODE) {
-			if (!get_bits(&buf, 8)) return 0;/* zero byte */
-			if (!next_bits(&buf, 24)) return 0;
+		std::size_t size = indata.size();
+		std::size_t pos = (tell() + 7) / 8;  // Skip stuffed zero bits
+		while (pos + 3 <= size) {
+			// Start codes begin with a zero byte, so look for one eight bytes at a time
+			if (pos + 8 <= size) {
+				uint64_t w = bitfiles::loadBE64(&indata[pos]);
+				const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+				uint64_t zero = ~(((w & low7) + low7) | w | low7);  // High bit set in each zero byte
+				if (!zero) { pos += 8; continue; }
+				pos += __builtin_clzll(zero) / 8;
+			} else if (indata[pos]) { ++pos; continue; }
+			if (pos + 3 <= size && !indata[pos] && !indata[pos + 1] && indata[pos + 2] == 1) {
+				setpos(pos, 0);
+				return 1;
+			}
+			++pos;
 		}
-		return 1;
+		setpos(size, 0);
+		return 0;
 	}
 
 	int get_dcs_y() {
-		int bits;
-		if(!(bits = get(2))) return 1; // 00
-		if(bits == 1)        return 2; // 01
-		bits <<= 1;
-		bits |= get(1);
-		if(bits == 4) return 0; // 100
-		if(bits == 5) return 3; // 101
-		if(bits == 6) return 4; // 110
-		if(!get(1)) return 5;
-		if(!get(1)) return 6;
-		if(!get(1)) return 7;
-		if(!get(1)) return 8;
-		if(!get(1)) return 9;
-		if(!get(1)) return 10;
-		return 11;
+		// Codes: 00, 01, 100, 101, 110 and then 1110, 11110, ... up to nine bits
+		unsigned int bits = peek(9);
+		if (bits < 0x100) { skip(2); return (bits >> 7) + 1; }  // 00 -> 1, 01 -> 2
+		if (bits < 0x1C0) {
+			static const int size[3] = { 0, 3, 4 };  // 100, 101, 110
+			skip(3);
+			return size[(bits >> 6) - 4];
+		}
+		unsigned int ones = __builtin_clz(~(bits << 23));
+		if (ones >= 9) { skip(9); return 11; }
+		skip(ones + 1);
+		return ones + 2;
 	}
 
 	int get_dcs_c() {
-		int bits;
-		if(!(bits = get(2))) return 0; // 00
-		if(bits == 1) return 1; // 01
-		if(bits == 2) return 2; // 10
-		if(!get(1)) return 3;
-		if(!get(1)) return 4;
-		if(!get(1)) return 5;
-		if(!get(1)) return 6;
-		if(!get(1)) return 7;
-		if(!get(1)) return 8;
-		if(!get(1)) return 9;
-		if(!get(1)) return 10;
-		return 11;
+		// Codes: 00, 01, 10 and then 110, 1110, ... up to ten bits
+		unsigned int bits = peek(10);
+		if (bits < 0x300) { skip(2); return bits >> 8; }
+		unsigned int ones = __builtin_clz(~(bits << 22));
+		if (ones >= 10) { skip(10); return 11; }
+		skip(ones + 1);
+		return ones + 1;
 	}
   private:
-	int get_bits(unsigned int *destBuf, unsigned int num_bits) {
-		*destBuf = 0;
-		for (unsigned int index = 0; index < num_bits; ++index) {
-			if (wdIndex >= indata.size()) return 0;
-			/* get next bit */
-			*destBuf <<= 1;
-			if (indata[wdIndex] & wdMask) *destBuf |= 1;
-			/* update bit pointer */
-			if (wdMask > 1) wdMask >>= 1;
-			else {
-				wdIndex++;
-				wdMask = BYTE_START;
+	/// Load whole bytes into the cache until it has at least 57 bits (or the data ends).
+	void refill() {
+		if (m_next + 8 <= indata.size()) {
+			// Bits loaded beyond m_bits are those of the next byte, so loading it again later is harmless
+			m_cache |= bitfiles::loadBE64(&indata[m_next]) >> m_bits;
+			unsigned int bytes = (64 - m_bits) / 8;
+			m_next += bytes;
+			m_bits += bytes * 8;
+		} else {
+			while (m_bits <= 56 && m_next < indata.size()) {
+				m_cache |= uint64_t(static_cast<unsigned char>(indata[m_next++])) << (56 - m_bits);
+				m_bits += 8;
 			}
 		}
-		return 1;
-	}
-	
-	int next_bits(unsigned int *destBuf, int num_bits) {
-		/* save current buffer state */
-		unsigned wdMaskSave = wdMask;
-		unsigned wdIndexSave = wdIndex;
-		int ret = get_bits(destBuf, num_bits);
-		/* restore previous buffer state */
-		wdMask = wdMaskSave;
-		wdIndex = wdIndexSave;
-		return ret;
 	}
-	
-	unsigned wdIndex;
-	unsigned wdMask;
+
 	std::vector<char> const& indata;
+	uint64_t m_cache;  // Left aligned, the first m_bits are valid
+	unsigned int m_bits;
+	std::size_t m_next;  // Next byte to be loaded into the cache
 };
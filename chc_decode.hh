@@ -1,13 +1,25 @@
 #pragma once
 
 #include <boost/crc.hpp>
+#include <algorithm>
+#include <map>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 #include <zlib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 // Class freely inspired from ALLconv by Holger Kuhn (hawkear@gmx.de)
 // Thanks for its help
 
+/** Decrypts a CHC melody archive once and keeps it, so that each melody is only a lookup and an inflate. **/
 class ChcDecode {
   public:
 	ChcDecode() {
@@ -15,50 +27,86 @@ class ChcDecode {
 			key_crc[i] = 0;
 		}
 	}
-	// TODO: move buffer uncypher inside load instead of getMelody
+	/// Set the keys (from config.xml), forgetting any archive decrypted with the previous ones
 	void load(std::string key[4]) {
 		for( unsigned int i = 0 ; i < 4 ; i++ ) {
 			boost::crc_32_type crc;
 			crc.process_bytes(key[i].c_str(), key[i].size()+1);
 			key_crc[i] = crc.checksum();
 		}
+		m_data.clear();
+		m_toc.clear();
 	}
-	std::string getMelody(char *buffer, unsigned int buffer_size, unsigned int id) {
-		unsigned int *chc_buffer = (unsigned int*)buffer;
-
-		if( buffer_size%8 != 0 ) throw std::runtime_error("CHC file is not 8 bytes padded");
-
-		for(unsigned int i = 0 ; i < buffer_size/8 ; i++) {
-			decrypt(&chc_buffer[i*2], key_crc);
-		}
-
+	/// Decrypt the CHC file and read its table of contents; the buffer is taken over (left empty)
+	void decrypt(std::vector<char>& buffer, unsigned int threads = 1) {
+		if( buffer.size()%8 != 0 ) throw std::runtime_error("CHC file is not 8 bytes padded");
+		m_data.clear();
+		m_toc.clear();
+		if( buffer.empty() ) throw std::runtime_error("CHC file is empty");
+		unsigned int *chc_buffer = reinterpret_cast<unsigned int*>(buffer.data());
+		// The first block holds the number of songs, check the key with it before decrypting the rest
+		decryptBlock(chc_buffer, key_crc);
 		unsigned int songs = chc_buffer[0];
-
 		if( songs > 100 ) throw std::runtime_error("CHC key probably wrong (too many songs)");
-
-		unsigned int start = 0;
-		uLongf packsize = 0;
-		uLong size = 0;
+		decryptBlocks(buffer.data() + 8, buffer.size() - 8, threads);
+		if( 4 * (1 + songs * 4) > buffer.size() ) throw std::runtime_error("CHC file is truncated");
 		for( unsigned int i = 0 ; i < songs ; i++) {
-			if( chc_buffer[1+i*4] == id ) {
-				start = chc_buffer[2+i*4];
-				packsize = chc_buffer[3+i*4];
-				size = chc_buffer[4+i*4];
-				break;
-			}
+			Entry e = { chc_buffer[2+i*4], chc_buffer[3+i*4], chc_buffer[4+i*4] };
+			if( e.start > buffer.size() || e.packsize > buffer.size() - e.start ) throw std::runtime_error("CHC key probably wrong (melody past the end of file)");
+			m_toc[chc_buffer[1+i*4]] = e;
 		}
-		if( packsize == 0 ) throw std::runtime_error("Melody not found in CHC file");
-
-		Bytef *dest = new Bytef[size];
-		uncompress(dest, &size, (Bytef*)buffer+start, packsize);
-		std::string result((char*)dest, (unsigned int)size);
-		delete[] dest;
-
+		m_data.swap(buffer);
+	}
+	/// Song ids of the decrypted file, in increasing order
+	std::vector<unsigned int> ids() const {
+		std::vector<unsigned int> ret;
+		for (auto const& e: m_toc) if (e.second.packsize) ret.push_back(e.first);
+		return ret;
+	}
+	/// Has a CHC file been decrypted with the current keys
+	bool loaded() const { return !m_data.empty(); }
+	/// Get the melody XML of a song of the decrypted file
+	std::string getMelody(unsigned int id) const {
+		auto it = m_toc.find(id);
+		if( it == m_toc.end() || it->second.packsize == 0 ) throw std::runtime_error("Melody not found in CHC file");
+		Entry const& e = it->second;
+		std::string result(e.size, '\0');
+		uLongf size = e.size;
+		if( uncompress(reinterpret_cast<Bytef*>(&result[0]), &size, reinterpret_cast<Bytef const*>(&m_data[e.start]), e.packsize) != Z_OK ) {
+			throw std::runtime_error("Melody in CHC file is corrupted");
+		}
+		result.resize(size);
 		return result;
 	}
+	/** Decrypt size (a multiple of 8) bytes in place. The blocks are independent, so they are
+	* decrypted several at a time with SIMD and large buffers are split between threads.
+	**/
+	void decryptBlocks(char* data, std::size_t size, unsigned int threads = 1) const {
+		unsigned int *v = reinterpret_cast<unsigned int*>(data);
+		std::size_t blocks = size / 8;
+		// Below 256 KiB per thread starting threads costs more than it saves
+		threads = std::max<std::size_t>(1, std::min<std::size_t>(threads, blocks / 32768));
+		std::vector<std::thread> workers;
+		std::size_t per = (blocks + threads - 1) / threads;
+		for (std::size_t begin = per; begin < blocks; begin += per) {
+			workers.emplace_back([this, v, begin, per, blocks] { decryptRange(v + 2 * begin, std::min(per, blocks - begin)); });
+		}
+		decryptRange(v, std::min(per, blocks));
+		for (auto& w: workers) w.join();
+	}
+	/// Decrypt one block at a time (the reference for the SIMD versions)
+	void decryptBlocksScalar(char* data, std::size_t size) const {
+		unsigned int *v = reinterpret_cast<unsigned int*>(data);
+		for (std::size_t i = 0; i < size / 8; ++i) decryptBlock(v + 2 * i, key_crc);
+	}
   private:
+	struct Entry {
+		unsigned int start, packsize, size;
+	};
 	unsigned int key_crc[4];
-	void decrypt(unsigned int *v, unsigned int k[4]) {
+	std::vector<char> m_data;  ///< Decrypted file
+	std::map<unsigned int, Entry> m_toc;  ///< By song id
+	static void decryptBlock(unsigned int *v, unsigned int const k[4]) {
 		unsigned int v0 = v[0], v1 = v[1], i;
 		unsigned int sum   = 0xC6EF3720;
 		unsigned int delta = 0x9e3779b9;
@@ -70,4 +118,55 @@ class ChcDecode {
 		} // end cycle
 		v[0] = v0; v[1] = v1;
 	}
+	/// Decrypt consecutive blocks (v0, v1 pairs), as many at a time as the instruction set allows
+	void decryptRange(unsigned int *v, std::size_t blocks) const {
+		std::size_t i = 0;
+#ifdef __AVX2__
+		{
+			__m256i k0 = _mm256_set1_epi32(key_crc[0]), k1 = _mm256_set1_epi32(key_crc[1]);
+			__m256i k2 = _mm256_set1_epi32(key_crc[2]), k3 = _mm256_set1_epi32(key_crc[3]);
+			for (; i + 8 <= blocks; i += 8) {
+				__m256i* p = reinterpret_cast<__m256i*>(v + 2 * i);
+				__m256 a = _mm256_castsi256_ps(_mm256_loadu_si256(p)), b = _mm256_castsi256_ps(_mm256_loadu_si256(p + 1));
+				// Split into the first and second words of each block (in lane order, undone by the unpacks below)
+				__m256i v0 = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+				__m256i v1 = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+				unsigned int sum = 0xC6EF3720;
+				for (unsigned int r = 0; r < 32; ++r, sum -= 0x9e3779b9) {
+					__m256i s = _mm256_set1_epi32(sum);
+					v1 = _mm256_sub_epi32(v1, _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(v0, 4), _mm256_xor_si256(k2, v0)),
+					  _mm256_add_epi32(_mm256_xor_si256(s, _mm256_srli_epi32(v0, 5)), k3)));
+					v0 = _mm256_sub_epi32(v0, _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(v1, 4), _mm256_xor_si256(k0, v1)),
+					  _mm256_add_epi32(_mm256_xor_si256(s, _mm256_srli_epi32(v1, 5)), k1)));
+				}
+				_mm256_storeu_si256(p, _mm256_unpacklo_epi32(v0, v1));
+				_mm256_storeu_si256(p + 1, _mm256_unpackhi_epi32(v0, v1));
+			}
+		}
+#endif
+#ifdef __SSE2__
+		{
+			__m128i k0 = _mm_set1_epi32(key_crc[0]), k1 = _mm_set1_epi32(key_crc[1]);
+			__m128i k2 = _mm_set1_epi32(key_crc[2]), k3 = _mm_set1_epi32(key_crc[3]);
+			for (; i + 4 <= blocks; i += 4) {
+				__m128i* p = reinterpret_cast<__m128i*>(v + 2 * i);
+				__m128 a = _mm_castsi128_ps(_mm_loadu_si128(p)), b = _mm_castsi128_ps(_mm_loadu_si128(p + 1));
+				// Split into the first and second words of each block
+				__m128i v0 = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+				__m128i v1 = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+				unsigned int sum = 0xC6EF3720;
+				for (unsigned int r = 0; r < 32; ++r, sum -= 0x9e3779b9) {
+					__m128i s = _mm_set1_epi32(sum);
+					v1 = _mm_sub_epi32(v1, _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(v0, 4), _mm_xor_si128(k2, v0)),
+					  _mm_add_epi32(_mm_xor_si128(s, _mm_srli_epi32(v0, 5)), k3)));
+					v0 = _mm_sub_epi32(v0, _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(v1, 4), _mm_xor_si128(k0, v1)),
+					  _mm_add_epi32(_mm_xor_si128(s, _mm_srli_epi32(v1, 5)), k1)));
+				}
+				_mm_storeu_si128(p, _mm_unpacklo_epi32(v0, v1));
+				_mm_storeu_si128(p + 1, _mm_unpackhi_epi32(v0, v1));
+			}
+		}
+#endif
+		for (; i < blocks; ++i) decryptBlock(v + 2 * i, key_crc);
+	}
 };
@@ -0,0 +1,21 @@
+# - Try to find LAME (libmp3lame)
+# Once done, this will define
+#
+#  Lame_FOUND - system has LAME
+#  Lame_INCLUDE_DIRS - the LAME include directories
+#  Lame_LIBRARIES - link these to use LAME
+
+include(LibFindMacros)
+
+find_path(Lame_INCLUDE_DIR
+  NAMES lame/lame.h
+)
+
+find_library(Lame_LIBRARY
+  NAMES mp3lame
+)
+
+set(Lame_PROCESS_INCLUDES Lame_INCLUDE_DIR)
+set(Lame_PROCESS_LIBS Lame_LIBRARY)
+libfind_process(Lame)
+
@@ -0,0 +1,34 @@
+# - Try to find libavformat, libavcodec and libavutil (from FFmpeg)
+# Once done, this will define
+#
+#  LibAV_FOUND - system has the libraries
+#  LibAV_INCLUDE_DIRS - the include directories
+#  LibAV_LIBRARIES - link these to use them
+
+include(LibFindMacros)
+
+libfind_pkg_check_modules(LibAV_PKGCONF libavformat libavcodec libavutil)
+
+find_path(LibAV_INCLUDE_DIR
+  NAMES libavformat/avformat.h
+  HINTS ${LibAV_PKGCONF_INCLUDE_DIRS}
+)
+
+find_library(AVFormat_LIBRARY
+  NAMES avformat
+  HINTS ${LibAV_PKGCONF_LIBRARY_DIRS}
+)
+
+find_library(AVCodec_LIBRARY
+  NAMES avcodec
+  HINTS ${LibAV_PKGCONF_LIBRARY_DIRS}
+)
+
+find_library(AVUtil_LIBRARY
+  NAMES avutil
+  HINTS ${LibAV_PKGCONF_LIBRARY_DIRS}
+)
+
+set(LibAV_PROCESS_INCLUDES LibAV_INCLUDE_DIR)
+set(LibAV_PROCESS_LIBS AVFormat_LIBRARY AVCodec_LIBRARY AVUtil_LIBRARY)
+libfind_process(LibAV)
@@ -0,0 +1,35 @@
+# - Try to find Vorbis (with the vorbisenc encoder library and libogg)
+# Once done, this will define
+#
+#  Vorbis_FOUND - system has Vorbis
+#  Vorbis_INCLUDE_DIRS - the Vorbis include directories
+#  Vorbis_LIBRARIES - link these to use Vorbis
+
+include(LibFindMacros)
+
+libfind_pkg_check_modules(Vorbis_PKGCONF vorbisenc)
+
+find_path(Vorbis_INCLUDE_DIR
+  NAMES vorbis/vorbisenc.h
+  HINTS ${Vorbis_PKGCONF_INCLUDE_DIRS}
+)
+
+find_library(Vorbisenc_LIBRARY
+  NAMES vorbisenc
+  HINTS ${Vorbis_PKGCONF_LIBRARY_DIRS}
+)
+
+find_library(Vorbis_LIBRARY
+  NAMES vorbis
+  HINTS ${Vorbis_PKGCONF_LIBRARY_DIRS}
+)
+
+find_library(Ogg_LIBRARY
+  NAMES ogg
+  HINTS ${Vorbis_PKGCONF_LIBRARY_DIRS}
+)
+
+set(Vorbis_PROCESS_INCLUDES Vorbis_INCLUDE_DIR)
+set(Vorbis_PROCESS_LIBS Vorbisenc_LIBRARY Vorbis_LIBRARY Ogg_LIBRARY)
+libfind_process(Vorbis)
+
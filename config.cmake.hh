@@ -3,3 +3,13 @@
 // libxml++ version
 #define LIBXMLPP_VERSION_2_6 @LibXML++_VERSION_2_6@
 #define LIBXMLPP_VERSION_3_0 @LibXML++_VERSION_3_0@
+
+// Optional in-process audio encoders
+#cmakedefine HAVE_VORBIS
+#cmakedefine HAVE_LAME
+
+// Optional in-process video transcoding
+#cmakedefine HAVE_LIBAV
+
+// Optional audio output
+#cmakedefine HAVE_PORTAUDIO
@@ -5,6 +5,7 @@
 #include <jpeglib.h>
 #include <png.h>
 
+#include <cstdio>
 #include <iostream>
 #include <string>
 
@@ -146,6 +147,39 @@ void writePNG(fs::path const& filename, Bitmap const& img, unsigned stride) {
 	writePNG_internal(pngPtr, infoPtr, file, img.width, img.height, colorType, rows);
 }
 
+void writeJPEG(fs::path const& filename, Bitmap const& bitmap, int quality) {
+	std::clog << "image/debug: Saving JPEG: " + filename.string() << std::endl;
+	if (bitmap.fmt != pix::RGB) throw std::logic_error("Unsupported pixel format in writeJPEG");
+	FILE* file = std::fopen(filename.string().c_str(), "wb");
+	if (!file) throw std::runtime_error("Cannot open " + filename.string());
+	struct my_jpeg_error_mgr jerr;
+	jpeg_compress_struct cinfo;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_jpeg_error_exit;
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_compress(&cinfo);
+		std::fclose(file);
+		throw std::runtime_error("Error in libjpeg when encoding " + filename.string());
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, file);
+	cinfo.image_width = bitmap.width;
+	cinfo.image_height = bitmap.height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		unsigned row = bitmap.bottomFirst ? bitmap.height - 1 - cinfo.next_scanline : cinfo.next_scanline;
+		JSAMPROW ptr = const_cast<JSAMPROW>(&bitmap.data()[row * bitmap.width * 3]);
+		jpeg_write_scanlines(&cinfo, &ptr, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	if (std::fclose(file)) throw std::runtime_error("Writing " + filename.string() + " failed");
+}
+
 void loadPNG(Bitmap& bitmap, fs::path const& filename) {
 	std::clog << "image/debug: Loading PNG: " + filename.string() << std::endl;
 	// A hack to assume linear premultiplied data if file extension is .premul.png (used for cached SVGs)
@@ -49,6 +49,8 @@ struct Bitmap {
 
 // The total number of bytes per line (stride) may be specified. By default no padding at end of line is assumed.
 void writePNG(fs::path const& filename, Bitmap const& bitmap, unsigned stride = 0);
+// Only pix::RGB bitmaps can be written as JPEG. Quality is 0...100.
+void writeJPEG(fs::path const& filename, Bitmap const& bitmap, int quality = 85);
 void loadPNG(Bitmap& bitmap, fs::path const& filename);
 void loadJPEG(Bitmap& bitmap, fs::path const& filename);
 
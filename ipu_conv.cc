@@ -1,12 +1,213 @@
 #include "ipuconv.hh"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
-IPUConv::IPUConv(std::vector<char> const& indata, std::string const& outfilename, bool pal): infile(indata), outfile(outfilename.c_str()) {
-	int sizex;
-	int sizey;
-	int frames;
-	int frame;
+namespace {
+	/// Result of IPUConv::vlc
+	enum { VLC_COEFF, VLC_EOB, VLC_ESCAPE, VLC_LONG };
+
+	struct VlcEntry { unsigned char len, type; };
+
+	/** Length (incl. sign bit) and type of MPEG-1 AC coefficient codes, indexed by their first eight bits. **/
+	struct VlcTable {
+		VlcEntry entry[256];
+		VlcTable() {
+			for (unsigned int b = 0; b < 256; ++b) entry[b] = make(b);
+		}
+		static VlcEntry make(unsigned int b) {
+			VlcEntry e = { 0, VLC_COEFF };
+			if (b >> 6 == 2) { e.len = 2; e.type = VLC_EOB; }  // 10
+			else if (b >> 6 == 3) e.len = 3;  // 11s
+			else if (b >> 5 == 3) e.len = 4;  // 011s
+			else if (b >> 5 == 2) e.len = 5;  // 010xs
+			else if (b >> 5 == 1) e.len = (b >> 3 & 3) ? 6 : 9;  // 001xxs, 00100xxxs
+			else if (b >> 4 == 1) e.len = 7;  // 0001xxs
+			else if (b >> 3 == 1) e.len = 8;  // 00001xxs
+			else if (b >> 2 == 1) { e.len = 24; e.type = VLC_ESCAPE; }  // 000001 + 6 bit run + 12 bit level
+			else if (b >> 1 == 1) e.len = 11;  // 0000001xxxs
+			else if (b == 1) e.len = 13;  // 00000001xxxxs
+			else e.type = VLC_LONG;
+			return e;
+		}
+	};
+
+	const VlcTable vlcTable;
+
+	/// Maximum GOP length, limited by the 10 bit temporal reference
+	const int MAX_GOP = 1024;
+
+	/// Write the time code of a GOP header (non-drop frame, counting at the nominal 25 or 30 fps)
+	void putTimecode(outBitFile& outfile, int frame, bool pal) {
+		int fps = pal ? 25 : 30;
+		outfile.putbits(0,1);				// Drop Frame
+		outfile.putbits(frame/fps/60/60%24,5);	// Stunden
+		outfile.putbits(frame/fps/60%60,6);	// Minuten
+		outfile.putbits(1,1);				// Marker
+		outfile.putbits(frame/fps%60,6);	// Sekunden
+		outfile.putbits(frame%fps,6);		// Frames
+	}
+}
+
+IPUConv::IPUConv(std::vector<char> const& indata, std::string const& outfilename, bool pal, unsigned threads, unsigned gop):
+  output(outfilename.c_str()), pal(pal), gop(std::min<int>(std::max(1u, gop), MAX_GOP)) {
+	std::size_t pos = 0;
+	convert([&indata, &pos](char* buf, std::size_t size) {
+		size = std::min(size, indata.size() - pos);
+		std::copy(indata.begin() + pos, indata.begin() + pos + size, buf);
+		pos += size;
+		return size;
+	}, threads, IPURange());
+}
+
+IPUConv::IPUConv(IPUSource const& source, std::string const& outfilename, bool pal, unsigned threads, IPURange const& range, unsigned gop):
+  output(outfilename.c_str()), pal(pal), gop(std::min<int>(std::max(1u, gop), MAX_GOP)) {
+	convert(source, threads, range);
+}
+
+IPUConv::IPUConv(IPUSource const& source, IPUSink const& sink, bool pal, unsigned threads, IPURange const& range, unsigned gop):
+  pal(pal), gop(std::min<int>(std::max(1u, gop), MAX_GOP)), sink(sink) {
+	convert(source, threads, range);
+}
+
+void IPUConv::convert(IPUSource const& source, unsigned threads, IPURange const& range) {
+	IPUFrameReader reader(source);
+	frames = reader.readHeader(sizex, sizey);
+
+	printf("%dx%d\n",sizex,sizey);
+	int fps = pal ? 25 : 30;
+	printf("%02d:%02d:%02d.%02d\n\n",frames/fps/60/60,frames/fps/60%60,frames/fps%60,frames%fps);
+
+	if (range.first && range.first >= unsigned(frames)) throw std::runtime_error("Start is past the end of the video");
+	int first = range.first;
+	count = range.count ? std::min<int>(range.count, frames - first) : frames - first;
+	reader.seek(first, range.index, range.seek);
+
+	if (threads > 1 && count > 1) convertParallel(reader, threads);
+	else convertSequential(reader);
+
+	if (!sink) output.putbits(0x1b7,32);		// Ende
+}
+
+void IPUConv::convertSequential(IPUFrameReader& reader) {
+	std::vector<t_MBData> MBData((sizex/16)*(sizey/16)+1);
+	std::vector<char> data;
+	for (int frame = 0; frame < count; ++frame) {
+		if (frame % 100 == 0) std::cout << "Frame: " << frame << "/" << count << "\r" << std::flush;
+		if (!reader.next(data)) throw std::runtime_error("End of Stream");
+		inBitFile infile(data);
+		convertFrame(infile, output, frame, MBData);
+		if (sink) {
+			// The output collects a single frame in memory
+			std::vector<char> out = output.data();
+			output.clear();
+			putFrame(out, frame);
+		}
+	}
+}
+
+void IPUConv::convertParallel(IPUFrameReader& reader, unsigned threads) {
+	// Workers convert frames into memory, at most window frames ahead of the writer
+	const int window = 4 * threads;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<std::pair<int, std::vector<char>>> queue;  // Frames waiting for a worker
+	// Indexed by frame % window
+	std::vector<std::vector<char>> result(window);
+	std::vector<std::exception_ptr> error(window);
+	std::vector<char> done(window);
+	bool quit = false;
+	auto worker = [&]() {
+		std::vector<t_MBData> MBData((sizex/16)*(sizey/16)+1);
+		std::unique_lock<std::mutex> l(mutex);
+		while (true) {
+			cond.wait(l, [&]{ return quit || !queue.empty(); });
+			if (queue.empty()) return;
+			int frame = queue.front().first;
+			std::vector<char> data;
+			data.swap(queue.front().second);
+			queue.pop_front();
+			l.unlock();
+			inBitFile in(data);
+			outBitFile out;
+			std::exception_ptr err;
+			try {
+				convertFrame(in, out, frame, MBData);
+			} catch (...) {
+				err = std::current_exception();
+			}
+			l.lock();
+			result[frame % window] = out.data();
+			error[frame % window] = err;
+			done[frame % window] = true;
+			cond.notify_all();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned i = 0; i < threads; ++i) pool.emplace_back(worker);
+
+	try {
+		int read = 0, available = count;
+		for (int frame = 0; frame < count; ++frame) {
+			// Keep the workers busy
+			for (; read < available && read < frame + window; ++read) {
+				std::vector<char> data;
+				if (!reader.next(data)) available = read;
+				else {
+					std::lock_guard<std::mutex> l(mutex);
+					queue.emplace_back(read, std::move(data));
+					cond.notify_one();
+				}
+			}
+			if (frame >= available) throw std::runtime_error("End of Stream");
+			std::vector<char> data;
+			{
+				std::unique_lock<std::mutex> l(mutex);
+				cond.wait(l, [&]{ return done[frame % window]; });
+				done[frame % window] = false;
+				data.swap(result[frame % window]);
+				if (error[frame % window]) std::rethrow_exception(error[frame % window]);
+			}
+			if (frame % 100 == 0) std::cout << "Frame: " << frame << "/" << count << "\r" << std::flush;
+			putFrame(data, frame);
+		}
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			quit = true;
+			queue.clear();
+			cond.notify_all();
+		}
+		for (auto& t: pool) t.join();
+		throw;
+	}
+	{
+		std::lock_guard<std::mutex> l(mutex);
+		quit = true;
+		cond.notify_all();
+	}
+	for (auto& t: pool) t.join();
+}
+
+void IPUConv::putFrame(std::vector<char>& data, int frame) {
+	if (!sink) {
+		output.putbytes(data.data(), data.size());
+		return;
+	}
+	if (frame == count - 1) {
+		static const char end[] = { 0, 0, 1, char(0xb7) };	// Ende
+		data.insert(data.end(), end, end + sizeof(end));
+	}
+	sink(data.data(), data.size());
+}
+
+void IPUConv::convertFrame(inBitFile& infile, outBitFile& outfile, int frame, std::vector<t_MBData>& MBData) const {
 	int dct_dc_y;
 	int dct_dc_cb;
 	int dct_dc_cr;
@@ -16,353 +217,259 @@ IPUConv::IPUConv(std::vector<char> const& indata, std::string const& outfilename
 	int mb_source;
 	int intraquant;
 	int block;
-	int eob;
 	int size;
 	int diff = 0;
-	int absval;
-	long int FrameByte;
-	unsigned int FrameBit;
-
-	if (0x6970756d != infile.get(32)) throw std::runtime_error("Input data is no IPU");
-
-	infile.get(32);	// Filesize
-
-	sizex=infile.get(8);
-	sizex=sizex+infile.get(8)*(1<<8);
-
-	sizey=infile.get(8);
-	sizey=sizey+infile.get(8)*(1<<8);
 
-	frames=infile.get(8);
-	frames=frames+infile.get(8)*(1<<8);
-	frames=frames+infile.get(8)*(1<<16);
-	frames=frames+infile.get(8)*(1<<24);
+	flag = infile.get(8);
+
+	if (flag & 32) throw std::runtime_error("Intra VLC format not supported");
+	if (frame==0) {
+		// Write Sequence Header
+		outfile.putbits(0x1b3,32);
+		outfile.putbits(sizex,12);
+		outfile.putbits(sizey,12);
+		outfile.putbits(0x1,4);			// Ascpect Ratio	1     1:1
+								//					2     4:3
+								//					3    16:9
+								//					4  2.21:1
+
+		if(pal) {
+			outfile.putbits(0x3,4);			// Framerate		3  25 fps
+		} else {
+			outfile.putbits(0x4,4);			// Framerate		4  29.97 fps
+		}
 
-	printf("%dx%d\n",sizex,sizey);
-	printf("%02d:%02d:%02d.%02d\n\n",frames/25/60/60,(frames%(25*60*60))/25/60,(frames%(25*60))/25,frames%25);
+		outfile.putbits(0x30d4,18);	// Bitrate ($3FFFF=Variabel)
+		outfile.putbits(1,1);			// Marker, soll immer 1 sein
+		outfile.putbits(112,10);		// VBV
+		outfile.putbits(0,1);			// Constrained Parameter Flag
+		outfile.putbits(0,1);			// Intra Matrix Standard
+		outfile.putbits(0,1);			// Non-Intra Matrix Standard
+		//outfile.putbits(0x2cee100,32);
 
-	std::vector<t_MBData> MBData((sizex/16)*(sizey/16)+1);
-	for (frame=0;frame<frames;frame++){
-		if (frame % 100 == 0) std::cout << "Frame: " << frame << "/" << frames << "\r" << std::flush;
-		flag = infile.get(8);
+		if (!(flag & 128)) {
+			// Sequence Extension
+			outfile.putbits(0x1b5,32);
+			outfile.putbits(0x1,4);		// Start Code Identifier
+			outfile.putbits(0x4,4);		// Main Profil
+			outfile.putbits(0x8,4);		// Main Level
+			outfile.putbits(0x1,1);		// Progressive Sequence
+			outfile.putbits(0x1,2);		// Chroma Format 4:2:0
+			outfile.putbits(0x0,2);		// Breite Extension
+			outfile.putbits(0x0,2);		// Höhe Extension
+			outfile.putbits(0x0,12);	// Bitrate Extension
+			outfile.putbits(0x1,1);		// Marker
+			outfile.putbits(0x0,8);		// VBV Buffer Extension
+			outfile.putbits(0x0,1);		// Low Delay
+			outfile.putbits(0x0,2);		// Framerate Extension Numerator
+			outfile.putbits(0x0,5);		// Framerate Extension Denominator
+			//outfile.putbits(0x148a0001,32);
+			//outfile.putbits(0,16);
+
+			// Sequence Display Extension
+			/*
+			outfile.putbits(0x1b5,32);
+			outfile.putbits(0x2,4);		// Start Code Identifier
+			outfile.putbits(0x1,3);		// Video Format		1 PAL
+			outfile.putbits(0x0,1);		// Bit Color
 
-		if (flag & 32) {
-			fprintf (stderr,"Intra VLC format not supported\n");
-			exit(1);
-		}
-		if (frame==0) {
-			// Write Sequence Header
-			outfile.putbits(0x1b3,32);
-			outfile.putbits(sizex,12);
-			outfile.putbits(sizey,12);
-			outfile.putbits(0x1,4);			// Ascpect Ratio	1     1:1
-									//					2     4:3
-									//					3    16:9
-									//					4  2.21:1
-
-			if(pal) {
-				outfile.putbits(0x3,4);			// Framerate		3  25 fps
-			} else {
-				outfile.putbits(0x4,4);			// Framerate		4  29.97 fps
-			}
+			outfile.putbits(0x23050504,32);
 
-			outfile.putbits(0x30d4,18);	// Bitrate ($3FFFF=Variabel)
-			outfile.putbits(1,1);			// Marker, soll immer 1 sein
-			outfile.putbits(112,10);		// VBV
-			outfile.putbits(0,1);			// Constrained Parameter Flag
-			outfile.putbits(0,1);			// Intra Matrix Standard
-			outfile.putbits(0,1);			// Non-Intra Matrix Standard
-			//outfile.putbits(0x2cee100,32);
-
-			if (!(flag & 128)) {
-				// Sequence Extension
-				outfile.putbits(0x1b5,32);
-				outfile.putbits(0x1,4);		// Start Code Identifier
-				outfile.putbits(0x4,4);		// Main Profil
-				outfile.putbits(0x8,4);		// Main Level
-				outfile.putbits(0x1,1);		// Progressive Sequence
-				outfile.putbits(0x1,2);		// Chroma Format 4:2:0
-				outfile.putbits(0x0,2);		// Breite Extension
-				outfile.putbits(0x0,2);		// Höhe Extension
-				outfile.putbits(0x0,12);	// Bitrate Extension
-				outfile.putbits(0x1,1);		// Marker
-				outfile.putbits(0x0,8);		// VBV Buffer Extension
-				outfile.putbits(0x0,1);		// Low Delay
-				outfile.putbits(0x0,2);		// Framerate Extension Numerator
-				outfile.putbits(0x0,5);		// Framerate Extension Denominator
-				//outfile.putbits(0x148a0001,32);
-				//outfile.putbits(0,16);
-
-				// Sequence Display Extension
-				/*
-				outfile.putbits(0x1b5,32);
-				outfile.putbits(0x2,4);		// Start Code Identifier
-				outfile.putbits(0x1,3);		// Video Format		1 PAL
-				outfile.putbits(0x0,1);		// Bit Color
-
-				outfile.putbits(0x23050504,32);
-
-				outfile.putbits(sizex,14);	// Display Breite
-				outfile.putbits(1,1);		// Marker
-				outfile.putbits(sizey,14);  // Display Höhe
-				outfile.putbits(0,3);
-				*/
-			}
+			outfile.putbits(sizex,14);	// Display Breite
+			outfile.putbits(1,1);		// Marker
+			outfile.putbits(sizey,14);  // Display Höhe
+			outfile.putbits(0,3);
+			*/
 		}
+	}
 
-		// Write GOP Header
+	// Write GOP Header (all pictures are intra coded, so display order is coding order)
+	if (frame % gop == 0) {
 		outfile.putbits(0x1b8,32);
-		outfile.putbits(0,1);				// Drop Frame
-		outfile.putbits(frame/25/60/60,5);	// Stunden
-		outfile.putbits((frame%(25*60*60))/25/60,6); // Minuten
-		outfile.putbits(1,1);				// Marker
-		outfile.putbits((frame%(25*60))/25,6);// Sekunden
-		outfile.putbits(frame%25,6);		// Frames
+		putTimecode(outfile, frame, pal);
 		outfile.putbits(1,1);				// Closed GOP
 		outfile.putbits(0,6);
+	}
 
-		// Write Picture Header
-		outfile.putbits(0x100,32);
-		outfile.putbits(0x0,10);			// Temporal Reference
-		outfile.putbits(0x1,3);				// Coding Type Intra
-		outfile.putbits(0xffff,16);			// VBV Delay
-		outfile.putbits(0,3);
+	// Write Picture Header
+	outfile.putbits(0x100,32);
+	outfile.putbits(frame % gop,10);	// Temporal Reference
+	outfile.putbits(0x1,3);				// Coding Type Intra
+	outfile.putbits(0xffff,16);			// VBV Delay
+	outfile.putbits(0,3);
 //		outfile.putbits(0xffff8,32);
 
-		// Write Picture Coding Extension
-		if (!(flag & 128)) {
-			outfile.putbits(0x1b5,32);
-			outfile.putbits(0x8ffff,20);
-			outfile.putbits(flag&3,2);			// Intra DC Precision
-			outfile.putbits(3,2);				// Frame Picture
-			outfile.putbits(2,3);
-			outfile.putbits((flag&64)/64,1);	// QST
-			outfile.putbits(0,1);				// Intra VLC Format
-			outfile.putbits((flag&16)/16,1);	// Alternate Scan
-			outfile.putbits(1,2);
-			outfile.putbits(0x80,8);
+	// Write Picture Coding Extension
+	if (!(flag & 128)) {
+		outfile.putbits(0x1b5,32);
+		outfile.putbits(0x8ffff,20);
+		outfile.putbits(flag&3,2);			// Intra DC Precision
+		outfile.putbits(3,2);				// Frame Picture
+		outfile.putbits(2,3);
+		outfile.putbits((flag&64)/64,1);	// QST
+		outfile.putbits(0,1);				// Intra VLC Format
+		outfile.putbits((flag&16)/16,1);	// Alternate Scan
+		outfile.putbits(1,2);
+		outfile.putbits(0x80,8);
+	}
+	// Write Slice Header
+	outfile.putbits(0x1,24);
+	outfile.putbits(1,8);
+	outfile.putbits(1,5);		// Quantiser
+	outfile.putbits(0,1);		// Extra Bit clear
+
+	// Scan Macroblocks, recording DC values and where the rest of each block is
+	dct_dc_y = 0;
+	dct_dc_cb = 0;
+	dct_dc_cr = 0;
+	quant = 1;
+	for(mb=0;mb<(sizex/16)*(sizey/16);mb++) {
+		t_MBData& m = MBData[mb];
+		if (mb>0 && !infile.get(1)) throw std::runtime_error("MBA_Incr wrong in IPU");
+
+		if (infile.get(1)) intraquant = 0;
+		else {
+			if (!infile.get(1)) throw std::runtime_error("MBT wrong in IPU");
+			intraquant = 1;
 		}
-		// Write Slice Header
-		outfile.putbits(0x1,24);
-		outfile.putbits(1,8);
-		outfile.putbits(1,5);		// Quantiser
-		outfile.putbits(0,1);		// Extra Bit clear
-
-		// infile.get Macroblock-infos
-		dct_dc_y = 0;
-		dct_dc_cb = 0;
-		dct_dc_cr = 0;
-		quant = 1;
-		for(mb=0;mb<(sizex/16)*(sizey/16);mb++) {
-			if (mb>0 && !infile.get(1)) throw std::runtime_error("MBA_Incr wrong in IPU");
-			// Save position (in IPU) of Macroblock
-			infile.getpos(&MBData[mb].Byte,&MBData[mb].Bit);
-
-			if (infile.get(1)) intraquant = 0;
-			else {
-				if (!infile.get(1)) throw std::runtime_error("MBT wrong in IPU");
-				intraquant = 1;
-			}
 
-			if (flag & 4) infile.get(1);
-			if (intraquant) quant = infile.get(5);
-			MBData[mb].quant = quant;
-
-			for(block=0;block<6;block++) {
-				if (block<4) {
-					if ( (size = infile.get_dcs_y())) {
-						diff = infile.get(size);
-						if (!(diff & (1 << (size - 1)))) diff = (-1 << size) | (diff + 1);
-						dct_dc_y += diff;
-					}
-					if (block==0) MBData[mb].dct_dc_y = dct_dc_y;
-				} else {
-					if ( (size = infile.get_dcs_c())) {
-						diff = infile.get(size);
-						if (!(diff & (1 << (size - 1)))) diff = (-1 << size) | (diff + 1);
-					}
-					if (block==4) {
-						if (size) dct_dc_cb += diff;
-						MBData[mb].dct_dc_cb = dct_dc_cb;
-					} else {
-						if (size) dct_dc_cr += diff;
-						MBData[mb].dct_dc_cr = dct_dc_cr;
-					}
-				}
-				do {
-					eob = vlc(0);
-					if (eob == 0) infile.get(1);
-					} while (eob!=1);
+		m.dct_type = (flag & 4) ? infile.get(1) : 0;
+		if (intraquant) quant = infile.get(5);
+		m.quant = quant;
+
+		for(block=0;block<6;block++) {
+			// Blocks 1-3 are copied as they are, DC included (their DC is relative to the previous block)
+			t_BitSpan& span = m.span[block == 0 ? 0 : block < 4 ? 1 : block - 2];
+			if (block == 1) span.pos = infile.tell();
+			size = (block<4) ? infile.get_dcs_y() : infile.get_dcs_c();
+			diff = 0;
+			if (size) {
+				diff = infile.get(size);
+				if (!(diff & (1 << (size - 1)))) diff -= (1 << size) - 1;
 			}
+			if (block<4) dct_dc_y += diff;
+			else if (block==4) dct_dc_cb += diff;
+			else dct_dc_cr += diff;
+			if (block == 0 || block > 3) span.pos = infile.tell();
+			while (vlc(infile) != VLC_EOB) {}
+			if (block == 1 || block == 2) continue;
+			span.len = infile.tell() - span.pos;
+			if (block == 0) m.dct_dc_y = dct_dc_y;
+			else if (block == 3) m.dct_dc_y3 = dct_dc_y;
+			else if (block == 4) m.dct_dc_cb = dct_dc_cb;
+			else m.dct_dc_cr = dct_dc_cr;
 		}
+	}
 
-		infile.getpos(&FrameByte,&FrameBit);	// Position speichern
-
-		// Write Macroblocks
-		dct_dc_y = 0;
-		dct_dc_cb = 0;
-		dct_dc_cr = 0;
-		quant = 1;
-		for(mb=0;mb<(sizex/16)*(sizey/16);mb++) {
-			mb_source = (mb % (sizex / 16)) * (sizey / 16)+ mb / (sizex / 16);	// Singstar
-			// mb_source = mb;							// Other IPUs
-
-			outfile.putbits(1,1);		// MBA_Incr=1
-
-			infile.setpos(MBData[mb_source].Byte,MBData[mb_source].Bit);
-
-			if (infile.get(1)) intraquant = 0;
-			else {
-				if (!infile.get(1)) throw std::runtime_error("MBT wrong in IPU");
-				intraquant = 1;
-			}
-
-			if (mb == 0 || (MBData[mb_source].quant != quant)) outfile.putbits(1,2);
-			else outfile.putbits(1,1);
-
-			if (flag & 4) outfile.putbits(infile.get(1),1);
-			if (intraquant) quant = infile.get(5);
-
-			if (mb == 0 || (MBData[mb_source].quant != quant)) {
-				outfile.putbits(MBData[mb_source].quant,5);
-				quant = MBData[mb_source].quant;
-			}
+	// Write Macroblocks in raster order, re-encoding the DC differentials
+	dct_dc_y = 0;
+	dct_dc_cb = 0;
+	dct_dc_cr = 0;
+	quant = 0;
+	for(mb=0;mb<(sizex/16)*(sizey/16);mb++) {
+		mb_source = (mb % (sizex / 16)) * (sizey / 16)+ mb / (sizex / 16);	// Singstar
+		// mb_source = mb;							// Other IPUs
+		t_MBData const& m = MBData[mb_source];
+
+		outfile.putbits(1,1);		// MBA_Incr=1
+
+		bool newquant = (mb == 0 || m.quant != quant);
+		outfile.putbits(1, newquant ? 2 : 1);	// Intra, with or without quantiser
+		if (flag & 4) outfile.putbits(m.dct_type,1);
+		if (newquant) outfile.putbits(quant = m.quant,5);
+
+		putdc(outfile, m.dct_dc_y - dct_dc_y, false);
+		infile.copy(outfile, m.span[0].pos, m.span[0].len);
+		infile.copy(outfile, m.span[1].pos, m.span[1].len);
+		dct_dc_y = m.dct_dc_y3;
+		putdc(outfile, m.dct_dc_cb - dct_dc_cb, true);
+		dct_dc_cb = m.dct_dc_cb;
+		infile.copy(outfile, m.span[2].pos, m.span[2].len);
+		putdc(outfile, m.dct_dc_cr - dct_dc_cr, true);
+		dct_dc_cr = m.dct_dc_cr;
+		infile.copy(outfile, m.span[3].pos, m.span[3].len);
+	}
+	outfile.putbuf();
 
-			for(block=0;block<6;block++) {
-				if (block==0) {
-					infile.get(infile.get_dcs_y());	// DCT_DC in Eingabestream überspringen
-					diff = MBData[mb_source].dct_dc_y - dct_dc_y;
-					dct_dc_y = MBData[mb_source].dct_dc_y;
-
-					absval = (diff<0) ? -diff : diff; /* abs(val) */
-					size = 0;
-					while (absval) {
-						absval >>= 1;
-						size++;
-					}
-					outfile.put_dcs_y(size);
-					absval = diff;
-					if (absval<=0)
-						absval += (1<<size) -1;
-					outfile.putbits(absval,size);
-				} else if (block>3)	{
-					infile.get(infile.get_dcs_c());	// DCT_DC in Eingabestream überspringen
-					if (block==4) {
-						diff = MBData[mb_source].dct_dc_cb - dct_dc_cb;
-						dct_dc_cb = MBData[mb_source].dct_dc_cb;
-					} else {
-						diff = MBData[mb_source].dct_dc_cr - dct_dc_cr;
-						dct_dc_cr = MBData[mb_source].dct_dc_cr;
-					}
-					absval = (diff<0) ? -diff : diff; /* abs(val) */
-					size = 0;
-					while (absval) {
-						absval >>= 1;
-						size++;
-					}
-					outfile.put_dcs_c(size);
-					absval = diff;
-					if (absval<=0)
-						absval += (1<<size) -1;
-					outfile.putbits(absval,size);
-				} else {
-					size = infile.get_dcs_y();
-					outfile.put_dcs_y(size);
-					diff = infile.get(size);
-					outfile.putbits(diff,size);		// DCT_DC kopieren (Blöcke 1,2,3)
-					if (size) {
-						if (!(diff&(1<<(size - 1))))
-							diff = (-1 << size) | (diff + 1);
-						dct_dc_y += diff;
-					}
-				}
-				do {
-					eob = vlc(1);
-					if (eob == 0)
-						outfile.putbits(infile.get(1),1);
-				} while (eob!=1);
-			}
-		}
-		outfile.putbuf();
+	// Jump to End of Frame
+	if (!infile.next_start_code()) throw std::runtime_error("End of Stream");
+	if (infile.get(32) != 0x000001b0) throw std::runtime_error("No 1b0");
+}
 
-		infile.setpos(FrameByte,FrameBit);
+void IPUIndex::build(IPUSource const& source) {
+	IPUFrameReader reader(source);
+	int sizex, sizey;
+	int frames = reader.readHeader(sizex, sizey);
+	std::vector<unsigned int> offsets;
+	std::vector<char> data;
+	for (int frame = 0; frame < frames; ++frame) {
+		offsets.push_back(reader.tell());
+		if (!reader.next(data)) throw std::runtime_error("End of Stream");
+	}
+	m_offsets.swap(offsets);
+}
 
-		// Jump to End of Frame
-		if (!infile.next_start_code()) throw std::runtime_error("End of Stream");
-		if (infile.get(32) != 0x000001b0) throw std::runtime_error("No 1b0");
+namespace {
+	void putLE(std::ostream& os, unsigned int val) {
+		for (unsigned i = 0; i < 4; ++i) os.put(static_cast<char>(val >> i * 8));
 	}
+	unsigned int getLE(std::istream& is) {
+		unsigned int val = 0;
+		for (unsigned i = 0; i < 4; ++i) val |= static_cast<unsigned char>(is.get()) << i * 8;
+		return val;
+	}
+}
 
-	outfile.putbits(0x1b7,32);		// Ende
+void IPUIndex::write(std::ostream& os) const {
+	os.write("SSII", 4);
+	putLE(os, 1);  // Version
+	putLE(os, m_offsets.size());
+	for (std::size_t i = 0; i < m_offsets.size(); ++i) putLE(os, m_offsets[i]);
 }
 
-int IPUConv::vlc(int write){
-	int bits;
-	int level=0;
-
-	bits = infile.get(2);
-	if (write) outfile.putbits(bits,2);
-	if(bits ==	2)
-		return(1);		// 10 - EOB
-	if(bits ==	3)
-		return(0);		// 11
-	if(bits ==	1) {
-		bits = infile.get(1);
-		if (write) outfile.putbits(bits,1);
-		if (bits)
-			return(0);
-		else {
-			bits = infile.get(1);
-			if (write) outfile.putbits(bits,1);
-			return(0);
-		}
+void IPUIndex::read(std::istream& is) {
+	char magic[4];
+	is.read(magic, 4);
+	if (!is || std::string(magic, 4) != "SSII" || getLE(is) != 1) throw std::runtime_error("Not a valid IPU index");
+	// The count is not trusted for allocating: offsets are added only as they are read
+	unsigned int count = getLE(is);
+	std::vector<unsigned int> offsets;
+	offsets.reserve(std::min(count, 1u << 16));
+	for (unsigned int i = 0; is && i < count; ++i) {
+		unsigned int offset = getLE(is);
+		if (!is) break;
+		if (!offsets.empty() && offset <= offsets.back()) throw std::runtime_error("Not a valid IPU index");
+		offsets.push_back(offset);
 	}
-	// 00
-	bits = infile.get(1);
-	if (write) outfile.putbits(bits,1);
-	if (bits) {
-		// 001
-		bits = infile.get(2);
-		if (write) outfile.putbits(bits,2);
-		if (bits < 1) {
-			// 00100
-			bits = infile.get(3);
-			if (write) outfile.putbits(bits,3);
-		}
-		// 001xx
-		return(0);
-	} else {
-	// 000
-		bits = infile.get(3);
-		if (write) outfile.putbits(bits,3);
-		if(bits >=	4)
-			return(0);
-		if(bits >=	2) {
-			bits = infile.get(1);
-			if (write) outfile.putbits(bits,1);
-			return(0);
-		}
-		if(bits) {
-			bits = infile.get(18);
-			if (write) outfile.putbits(bits,18);
-			return(2);	// Escape
-		}
-		bits = infile.get(1);
-		if (write) outfile.putbits(bits,1);
-		if(bits) {
-			bits = infile.get(3);
-			if (write) outfile.putbits(bits,3);
-			return(0);
-		}
-		do {
-			bits = infile.get(1);
-			if (write) outfile.putbits(bits,1);
-			level++;
-		} while (!bits && level<6);
-		if (level<6) {
-			bits = infile.get(4);
-			if (write) outfile.putbits(bits,4);
-			return(0);
-		} else throw std::runtime_error("Invalid VLC");
+	if (!is) throw std::runtime_error("IPU index truncated");
+	m_offsets.swap(offsets);
+}
+
+void IPUConv::putdc(outBitFile& outfile, int diff, bool chroma) {
+	int absval = (diff<0) ? -diff : diff;
+	int size = 0;
+	while (absval) {
+		absval >>= 1;
+		size++;
 	}
+	if (chroma) outfile.put_dcs_c(size);
+	else outfile.put_dcs_y(size);
+	if (diff<=0) diff += (1<<size) -1;
+	outfile.putbits(diff,size);
 }
 
+int IPUConv::vlc(inBitFile& infile) {
+	unsigned int bits = infile.peek(16);
+	VlcEntry e = vlcTable.entry[bits >> 8];
+	unsigned int len = e.len;
+	int type = e.type;
+	if (type == VLC_LONG) {
+		// 0000 0000 followed by up to four more zeros, a one and five more bits (incl. sign)
+		unsigned int zeros = bits ? __builtin_clz(bits) - 16 : 16;
+		if (zeros >= 12) throw std::runtime_error("Invalid VLC");
+		len = zeros + 6;
+		type = VLC_COEFF;
+	}
+	infile.skip(len);
+	return type;
+}
@@ -0,0 +1,312 @@
+#include "ipu_decode.hh"
+#include "image.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+	/// Position of the n-th coefficient in a row major block, for the zigzag and alternate scans
+	const unsigned char scanZigzag[64] = {
+		0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+		12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+		35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+		58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+	};
+	const unsigned char scanAlternate[64] = {
+		0, 8, 16, 24, 1, 9, 2, 10, 17, 25, 32, 40, 48, 56, 57, 49,
+		41, 33, 26, 18, 3, 11, 4, 12, 19, 27, 34, 42, 50, 58, 35, 43,
+		51, 59, 20, 28, 5, 13, 6, 14, 21, 29, 36, 44, 52, 60, 37, 45,
+		53, 61, 22, 30, 7, 15, 23, 31, 38, 46, 54, 62, 39, 47, 55, 63
+	};
+
+	/// Default intra quantiser matrix (row major)
+	const unsigned char intraMatrix[64] = {
+		8, 16, 19, 22, 26, 27, 29, 34,
+		16, 16, 22, 24, 27, 29, 34, 37,
+		19, 22, 26, 27, 29, 34, 34, 38,
+		22, 22, 26, 27, 29, 34, 37, 40,
+		22, 26, 27, 29, 32, 35, 40, 48,
+		26, 27, 29, 32, 35, 40, 48, 58,
+		26, 27, 29, 34, 38, 46, 56, 69,
+		27, 29, 35, 38, 46, 56, 69, 83
+	};
+
+	/// Quantiser scale by quantiser_scale_code for q_scale_type 1
+	const unsigned char nonLinearScale[32] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 18, 20, 22,
+		24, 28, 32, 36, 40, 44, 48, 52, 56, 64, 72, 80, 88, 96, 104, 112
+	};
+
+	enum { RUN_EOB = 64, RUN_ESCAPE = 65 };
+
+	/// DCT coefficient codes of MPEG-2 table B.14, without the sign bit
+	struct AcCode { char const* code; unsigned char run, level; };
+	const AcCode acCodes[] = {
+		{ "10", RUN_EOB, 0 }, { "000001", RUN_ESCAPE, 0 },
+		{ "11", 0, 1 }, { "011", 1, 1 }, { "0100", 0, 2 }, { "0101", 2, 1 },
+		{ "00101", 0, 3 }, { "00111", 3, 1 }, { "00110", 4, 1 },
+		{ "000110", 1, 2 }, { "000111", 5, 1 }, { "000101", 6, 1 }, { "000100", 7, 1 },
+		{ "0000110", 0, 4 }, { "0000100", 2, 2 }, { "0000111", 8, 1 }, { "0000101", 9, 1 },
+		{ "00100110", 0, 5 }, { "00100001", 0, 6 }, { "00100101", 1, 3 }, { "00100100", 3, 2 },
+		{ "00100111", 10, 1 }, { "00100011", 11, 1 }, { "00100010", 12, 1 }, { "00100000", 13, 1 },
+		{ "0000001010", 0, 7 }, { "0000001100", 1, 4 }, { "0000001011", 2, 3 }, { "0000001111", 4, 2 },
+		{ "0000001001", 5, 2 }, { "0000001110", 14, 1 }, { "0000001101", 15, 1 }, { "0000001000", 16, 1 },
+		{ "000000011101", 0, 8 }, { "000000011000", 0, 9 }, { "000000010011", 0, 10 }, { "000000010000", 0, 11 },
+		{ "000000011011", 1, 5 }, { "000000010100", 2, 4 }, { "000000011100", 3, 3 }, { "000000010010", 4, 3 },
+		{ "000000011110", 6, 2 }, { "000000010101", 7, 2 }, { "000000010001", 8, 2 }, { "000000011111", 17, 1 },
+		{ "000000011010", 18, 1 }, { "000000011001", 19, 1 }, { "000000010111", 20, 1 }, { "000000010110", 21, 1 },
+		{ "0000000011010", 0, 12 }, { "0000000011001", 0, 13 }, { "0000000011000", 0, 14 }, { "0000000010111", 0, 15 },
+		{ "0000000010110", 1, 6 }, { "0000000010101", 1, 7 }, { "0000000010100", 2, 5 }, { "0000000010011", 3, 4 },
+		{ "0000000010010", 5, 3 }, { "0000000010001", 9, 2 }, { "0000000010000", 10, 2 }, { "0000000011111", 22, 1 },
+		{ "0000000011110", 23, 1 }, { "0000000011101", 24, 1 }, { "0000000011100", 25, 1 }, { "0000000011011", 26, 1 },
+		{ "00000000011111", 0, 16 }, { "00000000011110", 0, 17 }, { "00000000011101", 0, 18 }, { "00000000011100", 0, 19 },
+		{ "00000000011011", 0, 20 }, { "00000000011010", 0, 21 }, { "00000000011001", 0, 22 }, { "00000000011000", 0, 23 },
+		{ "00000000010111", 0, 24 }, { "00000000010110", 0, 25 }, { "00000000010101", 0, 26 }, { "00000000010100", 0, 27 },
+		{ "00000000010011", 0, 28 }, { "00000000010010", 0, 29 }, { "00000000010001", 0, 30 }, { "00000000010000", 0, 31 },
+		{ "000000000011000", 0, 32 }, { "000000000010111", 0, 33 }, { "000000000010110", 0, 34 }, { "000000000010101", 0, 35 },
+		{ "000000000010100", 0, 36 }, { "000000000010011", 0, 37 }, { "000000000010010", 0, 38 }, { "000000000010001", 0, 39 },
+		{ "000000000010000", 0, 40 }, { "000000000011111", 1, 8 }, { "000000000011110", 1, 9 }, { "000000000011101", 1, 10 },
+		{ "000000000011100", 1, 11 }, { "000000000011011", 1, 12 }, { "000000000011010", 1, 13 }, { "000000000011001", 1, 14 },
+		{ "0000000000010011", 1, 15 }, { "0000000000010010", 1, 16 }, { "0000000000010001", 1, 17 }, { "0000000000010000", 1, 18 },
+		{ "0000000000010100", 6, 3 }, { "0000000000011010", 11, 2 }, { "0000000000011001", 12, 2 }, { "0000000000011000", 13, 2 },
+		{ "0000000000010111", 14, 2 }, { "0000000000010110", 15, 2 }, { "0000000000010101", 16, 2 }, { "0000000000011111", 27, 1 },
+		{ "0000000000011110", 28, 1 }, { "0000000000011101", 29, 1 }, { "0000000000011100", 30, 1 }, { "0000000000011011", 31, 1 }
+	};
+
+	/** Lookup of acCodes by the number of leading zeros and the bits following the first one. **/
+	struct AcTable {
+		struct Entry { unsigned char len, run, level; };  // len 0 for invalid codes
+		static const unsigned MAX_ZEROS = 12;
+		unsigned bits[MAX_ZEROS];
+		std::vector<Entry> entries[MAX_ZEROS];
+		AcTable() {
+			std::fill(bits, bits + MAX_ZEROS, 0u);
+			for (AcCode const& c: acCodes) {
+				std::string code = c.code;
+				std::size_t zeros = code.find('1');
+				bits[zeros] = std::max<unsigned>(bits[zeros], code.size() - zeros - 1);
+			}
+			for (unsigned z = 0; z < MAX_ZEROS; ++z) entries[z].resize(1u << bits[z], Entry());
+			for (AcCode const& c: acCodes) {
+				std::string code = c.code;
+				std::size_t zeros = code.find('1');
+				std::string rest = code.substr(zeros + 1);
+				unsigned free = bits[zeros] - rest.size();
+				unsigned base = (rest.empty() ? 0 : std::stoul(rest, NULL, 2)) << free;
+				Entry e = { static_cast<unsigned char>(code.size()), c.run, c.level };
+				for (unsigned i = 0; i < 1u << free; ++i) entries[zeros][base + i] = e;
+			}
+		}
+		Entry const& find(unsigned int bits16) const {
+			unsigned z = bits16 ? __builtin_clz(bits16) - 16 : 16;
+			if (z >= MAX_ZEROS) throw std::runtime_error("Invalid VLC");
+			unsigned b = bits[z];
+			return entries[z][(bits16 >> (15 - z - b)) & ((1u << b) - 1)];
+		}
+	};
+	const AcTable acTable;
+
+	/** IDCT basis functions, m[u][x] = C(u) / 2 * cos((2x + 1) u pi / 16). **/
+	struct IdctBasis {
+		alignas(16) float m[8][8];
+		IdctBasis() {
+			for (int u = 0; u < 8; ++u) {
+				for (int x = 0; x < 8; ++x) m[u][x] = (u ? 1.0 : std::sqrt(0.5)) / 2.0 * std::cos((2 * x + 1) * u * M_PI / 16.0);
+			}
+		}
+	};
+	const IdctBasis idctBasis;
+
+	/// Inverse DCT of row major coefficients into pixels saturated to 0...255
+	void idct(int const* in, unsigned char* out, std::ptrdiff_t stride) {
+		alignas(16) float tmp[8][8];
+		unsigned rows = 0;  // Bit mask of rows with nonzero coefficients
+		float const (*m)[8] = idctBasis.m;
+#ifdef __SSE2__
+		// Rows: tmp[v][x] = sum_u in[v][u] m[u][x]
+		for (int v = 0; v < 8; ++v) {
+			__m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+			for (int u = 0; u < 8; ++u) {
+				int c = in[v * 8 + u];
+				if (!c) continue;
+				__m128 k = _mm_set1_ps(c);
+				lo = _mm_add_ps(lo, _mm_mul_ps(k, _mm_load_ps(m[u])));
+				hi = _mm_add_ps(hi, _mm_mul_ps(k, _mm_load_ps(m[u] + 4)));
+				rows |= 1 << v;
+			}
+			_mm_store_ps(tmp[v], lo);
+			_mm_store_ps(tmp[v] + 4, hi);
+		}
+		// Columns: out[y][x] = sum_v m[v][y] tmp[v][x]
+		for (int y = 0; y < 8; ++y) {
+			__m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+			for (int v = 0; v < 8; ++v) {
+				if (!(rows & 1 << v)) continue;
+				__m128 k = _mm_set1_ps(m[v][y]);
+				lo = _mm_add_ps(lo, _mm_mul_ps(k, _mm_load_ps(tmp[v])));
+				hi = _mm_add_ps(hi, _mm_mul_ps(k, _mm_load_ps(tmp[v] + 4)));
+			}
+			__m128i w = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out + y * stride), _mm_packus_epi16(w, w));
+		}
+#else
+		for (int v = 0; v < 8; ++v) {
+			std::fill(tmp[v], tmp[v] + 8, 0.0f);
+			for (int u = 0; u < 8; ++u) {
+				int c = in[v * 8 + u];
+				if (!c) continue;
+				for (int x = 0; x < 8; ++x) tmp[v][x] += c * m[u][x];
+				rows |= 1 << v;
+			}
+		}
+		for (int y = 0; y < 8; ++y) {
+			float sum[8] = {};
+			for (int v = 0; v < 8; ++v) {
+				if (!(rows & 1 << v)) continue;
+				for (int x = 0; x < 8; ++x) sum[x] += m[v][y] * tmp[v][x];
+			}
+			for (int x = 0; x < 8; ++x) out[y * stride + x] = std::min(255L, std::max(0L, std::lrint(sum[x])));
+		}
+#endif
+	}
+}
+
+void YUVFrame::resize(unsigned w, unsigned h) {
+	width = w;
+	height = h;
+	y.resize(w * h);
+	u.resize(w / 2 * (h / 2));
+	v.resize(w / 2 * (h / 2));
+}
+
+void YUVFrame::toRGB(Bitmap& bitmap) const {
+	bitmap.ptr = NULL;
+	bitmap.buf.resize(width * height * 3);
+	bitmap.width = width;
+	bitmap.height = height;
+	bitmap.ar = double(width) / height;
+	bitmap.fmt = pix::RGB;
+	bitmap.linearPremul = false;
+	unsigned char* out = bitmap.data();
+	for (unsigned row = 0; row < height; ++row) {
+		unsigned char const* luma = &y[row * width];
+		std::size_t chroma = row / 2 * (width / 2);
+		for (unsigned col = 0; col < width; ++col) {
+			int c = 298 * (luma[col] - 16) + 128;
+			int d = u[chroma + col / 2] - 128;
+			int e = v[chroma + col / 2] - 128;
+			*out++ = std::min(255, std::max(0, (c + 409 * e) >> 8));
+			*out++ = std::min(255, std::max(0, (c - 100 * d - 208 * e) >> 8));
+			*out++ = std::min(255, std::max(0, (c + 516 * d) >> 8));
+		}
+	}
+}
+
+IPUDecoder::IPUDecoder(IPUSource const& source, IPURange const& range): m_reader(source), m_range(range) {
+	m_frames = m_reader.readHeader(m_width, m_height);
+	unsigned int first = std::min<unsigned int>(range.first, m_frames);
+	m_end = range.count ? std::min<unsigned int>(first + range.count, m_frames) : m_frames;
+	m_reader.seek(first, m_range.index, m_range.seek);
+}
+
+bool IPUDecoder::decode(YUVFrame& frame) {
+	if (!skip()) return false;
+	decodeFrame(m_data, m_width, m_height, frame);
+	return true;
+}
+
+bool IPUDecoder::skip() {
+	if (m_reader.frame() >= m_end) return false;
+	if (!m_reader.next(m_data)) throw std::runtime_error("End of Stream");
+	return true;
+}
+
+void IPUDecoder::seek(unsigned int frame) {
+	m_reader.seek(frame, m_range.index, m_range.seek);
+}
+
+void IPUDecoder::decodeFrame(std::vector<char> const& data, int width, int height, YUVFrame& frame) {
+	int mbw = width / 16, mbh = height / 16;
+	frame.resize(mbw * 16, mbh * 16);
+	inBitFile infile(data);
+	int flag = infile.get(8);
+	if (flag & 32) throw std::runtime_error("Intra VLC format not supported");
+	bool mpeg1 = flag & 128;
+	int precision = flag & 3;
+	unsigned char const* scan = (flag & 16) ? scanAlternate : scanZigzag;
+	int dc[3] = { 128 << precision, 128 << precision, 128 << precision };
+	int quant = 1;
+	for (int mb = 0; mb < mbw * mbh; ++mb) {
+		if (mb > 0 && !infile.get(1)) throw std::runtime_error("MBA_Incr wrong in IPU");
+		bool intraquant = false;
+		if (!infile.get(1)) {
+			if (!infile.get(1)) throw std::runtime_error("MBT wrong in IPU");
+			intraquant = true;
+		}
+		bool fieldDCT = (flag & 4) && infile.get(1);
+		if (intraquant) quant = infile.get(5);
+		int qscale = mpeg1 ? quant : (flag & 64) ? nonLinearScale[quant] : 2 * quant;
+		// Macroblocks are stored column by column
+		int mbx = mb / mbh, mby = mb % mbh;
+		for (int block = 0; block < 6; ++block) {
+			int comp = block < 4 ? 0 : block - 3;
+			int size = comp ? infile.get_dcs_c() : infile.get_dcs_y();
+			if (size) {
+				int diff = infile.get(size);
+				if (!(diff & (1 << (size - 1)))) diff -= (1 << size) - 1;
+				dc[comp] += diff;
+			}
+			int coeff[64] = {};
+			coeff[0] = dc[comp] * (8 >> precision);
+			int sum = coeff[0];
+			for (int i = 0; ; ) {
+				AcTable::Entry const& e = acTable.find(infile.peek(16));
+				if (!e.len) throw std::runtime_error("Invalid VLC");
+				infile.skip(e.len);
+				if (e.run == RUN_EOB) break;
+				int level;
+				if (e.run == RUN_ESCAPE) {
+					i += infile.get(6) + 1;
+					level = infile.get(12);
+					if (level & 0x800) level -= 0x1000;
+				} else {
+					i += e.run + 1;
+					level = infile.get(1) ? -e.level : e.level;
+				}
+				if (i > 63) throw std::runtime_error("Too many DCT coefficients");
+				int pos = scan[i];
+				int val;
+				if (mpeg1) {
+					val = level * qscale * intraMatrix[pos] / 8;
+					if (!(val & 1) && val) val -= (val > 0) ? 1 : -1;  // Oddification
+				} else {
+					val = level * qscale * intraMatrix[pos] / 16;
+				}
+				val = std::min(2047, std::max(-2048, val));
+				coeff[pos] = val;
+				sum += val;
+			}
+			if (!mpeg1 && !(sum & 1)) coeff[63] ^= 1;  // Mismatch control
+			unsigned char* dst;
+			std::ptrdiff_t stride;
+			if (comp == 0) {
+				int x = mbx * 16 + (block & 1) * 8;
+				// With field DCT, blocks 0 and 1 hold the top field and blocks 2 and 3 the bottom field
+				int y = mby * 16 + (fieldDCT ? block >> 1 : (block >> 1) * 8);
+				stride = fieldDCT ? 2 * frame.width : frame.width;
+				dst = &frame.y[y * frame.width + x];
+			} else {
+				stride = frame.width / 2;
+				dst = &(comp == 1 ? frame.u : frame.v)[mby * 8 * stride + mbx * 8];
+			}
+			idct(coeff, dst, stride);
+		}
+	}
+}
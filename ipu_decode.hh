@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ipuconv.hh"
+#include <vector>
+
+struct Bitmap;
+
+/** A decoded picture as YUV 4:2:0 planes. **/
+struct YUVFrame {
+	YUVFrame(): width(), height() {}
+	unsigned width, height;  ///< Luma size, the chroma planes are half of it in both directions
+	std::vector<unsigned char> y, u, v;
+	void resize(unsigned w, unsigned h);
+	/// Convert to RGB (BT.601 studio range, chroma not interpolated)
+	void toRGB(Bitmap& bitmap) const;
+};
+
+/** Decoder for IPU videos, producing pixels without going through MPEG.
+* IPU frames are intra coded with the MPEG-2 tables (or MPEG-1 quantisation when flagged),
+* with macroblocks stored column by column.
+**/
+class IPUDecoder {
+  public:
+	IPUDecoder(IPUSource const& source, IPURange const& range = IPURange());
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	/// Number of frames in the whole video
+	int frames() const { return m_frames; }
+	/// Number of the next frame
+	unsigned int frame() const { return m_reader.frame(); }
+	/// Decode the next frame, returns false at the end of the range
+	bool decode(YUVFrame& frame);
+	/// Skip the next frame without decoding it, returns false at the end of the range
+	bool skip();
+	/// Continue at the given frame (seeking through the range's index if available)
+	void seek(unsigned int frame);
+	/// Decode one frame (as split by IPUFrameReader) of a video of the given size
+	static void decodeFrame(std::vector<char> const& data, int width, int height, YUVFrame& frame);
+  private:
+	IPUFrameReader m_reader;
+	IPURange m_range;
+	int m_width, m_height, m_frames;
+	unsigned int m_end;  ///< Frame after the range
+	std::vector<char> m_data;
+};
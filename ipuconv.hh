@@ -1,20 +1,200 @@
+#pragma once
+
 #include "bitfiles.h"
+#include <cstring>
+#include <functional>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+
+struct t_BitSpan	/*	Run of bits in the input	*/
+{
+	std::size_t pos;
+	std::size_t len;
+};
 
 struct t_MBData		/*	Macroblock data	*/
 {
-	long int Byte;
-	unsigned int Bit;
-	int dct_dc_y;
+	int dct_dc_y;	// DC of block 0
+	int dct_dc_y3;	// DC of block 3, the predictor for the next macroblock
 	int dct_dc_cb;
 	int dct_dc_cr;
 	int quant;
+	int dct_type;
+	t_BitSpan span[4];	// Block 0 AC, blocks 1-3 (DC and AC), block 4 AC, block 5 AC
 };
 
-class IPUConv {
-	inBitFile infile;
-	outBitFile outfile;
-	int vlc(int write);
+/// Reads up to size bytes of IPU data into buf, returning the number of bytes read (0 at end of stream)
+typedef std::function<std::size_t (char* buf, std::size_t size)> IPUSource;
+
+/// Moves an IPUSource to the given byte offset
+typedef std::function<void (std::size_t pos)> IPUSeek;
+
+/// Receives the converted MPEG video one picture at a time (the sequence end code comes with the last one)
+typedef std::function<void (char const* data, std::size_t size)> IPUSink;
+
+/** Seek index for IPU streams.
+* Frames are coded independently and each starts byte aligned right after the 0x1b0 start code
+* that ends the previous one, so the byte offset of every frame is all that is needed to start
+* conversion at any frame without scanning the stream up to it.
+**/
+class IPUIndex {
+  public:
+	/// Index a whole stream
+	void build(IPUSource const& source);
+	std::vector<unsigned int> const& offsets() const { return m_offsets; }
+	bool empty() const { return m_offsets.empty(); }
+	void write(std::ostream& os) const;
+	void read(std::istream& is);
+  private:
+	std::vector<unsigned int> m_offsets;
+};
+
+/** Splits an IPU stream into frames, reading it in chunks. **/
+class IPUFrameReader {
   public:
-	IPUConv(std::vector<char> const& indata, std::string const& outfilename, bool pal = true);
+	IPUFrameReader(IPUSource const& source): m_source(source), m_offset(), m_begin(), m_scan(), m_frame() {}
+
+	/// Stream offset of the next frame
+	std::size_t tell() const { return m_offset + m_begin; }
+
+	/// Number of the next frame
+	unsigned int frame() const { return m_frame; }
+
+	/// Parse the file header, returns the number of frames
+	int readHeader(int& sizex, int& sizey) {
+		std::vector<char> data = header(16);
+		inBitFile infile(data);
+		if (0x6970756d != infile.get(32)) throw std::runtime_error("Input data is no IPU");
+
+		infile.get(32);	// Filesize
+
+		sizex=infile.get(8);
+		sizex=sizex+infile.get(8)*(1<<8);
+
+		sizey=infile.get(8);
+		sizey=sizey+infile.get(8)*(1<<8);
+
+		int frames=infile.get(8);
+		frames=frames+infile.get(8)*(1<<8);
+		frames=frames+infile.get(8)*(1<<16);
+		frames=frames+infile.get(8)*(1<<24);
+		return frames;
+	}
+
+	/// Continue at the given frame, seeking through the index if possible and scanning forward otherwise
+	void seek(unsigned int frame, IPUIndex const* index = NULL, IPUSeek const& seek = IPUSeek()) {
+		if (frame == m_frame) return;
+		if (index && seek && frame < index->offsets().size()) {
+			std::size_t offset = index->offsets()[frame];
+			seek(offset);
+			m_buf.clear();
+			m_offset = offset;
+			m_begin = m_scan = 0;
+			m_frame = frame;
+			return;
+		}
+		if (frame < m_frame) throw std::logic_error("Cannot seek backwards in IPU stream without an index");
+		std::vector<char> data;
+		while (m_frame < frame) {
+			if (!next(data)) throw std::runtime_error("End of Stream");
+		}
+	}
+
+	/// Read size bytes from the beginning of the stream (the file header)
+	std::vector<char> header(std::size_t size) {
+		while (m_buf.size() < size && fill()) {}
+		if (m_buf.size() < size) throw std::runtime_error("Input data is no IPU");
+		m_begin = m_scan = size;
+		return std::vector<char>(m_buf.begin(), m_buf.begin() + size);
+	}
+
+	/// Get the next frame including the 0x000001b0 start code that ends it. Returns false at end of stream.
+	bool next(std::vector<char>& frame) {
+		while (true) {
+			// Look for the 0x01 of the start code, at least two bytes after the scan position
+			for (std::size_t i = m_scan + 2; i + 1 < m_buf.size(); ) {
+				char const* p = static_cast<char const*>(std::memchr(&m_buf[i], 1, m_buf.size() - 1 - i));
+				if (!p) break;
+				i = p - &m_buf[0];
+				if (!m_buf[i - 2] && !m_buf[i - 1] && static_cast<unsigned char>(m_buf[i + 1]) == 0xb0) {
+					frame.assign(m_buf.begin() + m_begin, m_buf.begin() + i + 2);
+					m_begin = m_scan = i + 2;
+					++m_frame;
+					return true;
+				}
+				++i;
+			}
+			// Keep the last three bytes, they may begin a start code
+			if (m_buf.size() > m_scan + 3) m_scan = m_buf.size() - 3;
+			if (!fill()) return false;
+		}
+	}
+
+  private:
+	static const std::size_t CHUNK_SIZE = 65536;
+	/// Drop the data before the current frame and read another chunk. Returns false at end of stream.
+	bool fill() {
+		m_buf.erase(m_buf.begin(), m_buf.begin() + m_begin);
+		m_offset += m_begin;
+		m_scan -= m_begin;
+		m_begin = 0;
+		std::size_t size = m_buf.size();
+		m_buf.resize(size + CHUNK_SIZE);
+		m_buf.resize(size + m_source(&m_buf[size], CHUNK_SIZE));
+		return m_buf.size() > size;
+	}
+
+	IPUSource m_source;
+	std::vector<char> m_buf;  // Window of the stream, from the current frame on
+	std::size_t m_offset;  // Stream offset of m_buf[0]
+	std::size_t m_begin;  // Start of the current frame in m_buf
+	std::size_t m_scan;  // Where the search for the end of the frame continues
+	unsigned int m_frame;
+};
+
+/** Part of a video to convert. **/
+struct IPURange {
+	IPURange(): first(), count(), index() {}
+	/// Frames covering the given time window (duration 0 for the rest of the video)
+	static IPURange time(double start, double duration, bool pal = true) {
+		double fps = pal ? 25.0 : 30000.0 / 1001.0;
+		IPURange r;
+		r.first = start * fps + 0.5;
+		r.count = duration * fps + 0.5;
+		if (duration > 0.0 && !r.count) r.count = 1;
+		return r;
+	}
+	unsigned int first;  ///< First frame
+	unsigned int count;  ///< Number of frames, 0 for the rest of the video
+	IPUIndex const* index;  ///< Used together with seek for jumping to the first frame instead of scanning
+	IPUSeek seek;
 };
 
+class IPUConv {
+	outBitFile output;
+	int sizex, sizey, frames;
+	int count;  // Frames to convert
+	bool pal;
+	int gop;  // Frames per GOP
+	IPUSink sink;  // Instead of the file, if set
+	void convert(IPUSource const& source, unsigned threads, IPURange const& range);
+	void convertSequential(IPUFrameReader& reader);
+	/// Convert frames on a thread pool
+	void convertParallel(IPUFrameReader& reader, unsigned threads);
+	/// Write a converted frame to the file or pass it to the sink
+	void putFrame(std::vector<char>& data, int frame);
+	/// Convert one frame, leaving infile after the start code that ends it; frame is numbered from the start of the output
+	void convertFrame(inBitFile& infile, outBitFile& outfile, int frame, std::vector<t_MBData>& MBData) const;
+	/// Skip one AC coefficient code, returns VLC_EOB at end of block
+	static int vlc(inBitFile& infile);
+	/// Write a DC differential
+	static void putdc(outBitFile& outfile, int diff, bool chroma);
+  public:
+	/// Convert IPU data into an MPEG file, using the given number of threads and grouping gop frames into each GOP
+	IPUConv(std::vector<char> const& indata, std::string const& outfilename, bool pal = true, unsigned threads = 1, unsigned gop = 1);
+	/// Convert streamed IPU data; only about one frame per thread is kept in memory
+	IPUConv(IPUSource const& source, std::string const& outfilename, bool pal = true, unsigned threads = 1, IPURange const& range = IPURange(), unsigned gop = 1);
+	/// Convert streamed IPU data, passing each converted picture to sink as soon as it is ready
+	IPUConv(IPUSource const& source, IPUSink const& sink, bool pal = true, unsigned threads = 1, IPURange const& range = IPURange(), unsigned gop = 1);
+};
@@ -1,25 +1,163 @@
+#include "image.hh"
 #include "ipuconv.hh"
+#include "ipu_decode.hh"
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <thread>
+
+/** Convert a frame to RGB, scaled down (by averaging) to the given width if it is smaller. **/
+static void thumbnail(YUVFrame const& frame, unsigned width, Bitmap& out) {
+	Bitmap full;
+	frame.toRGB(full);
+	if (!width || width >= full.width) { full.swap(out); return; }
+	unsigned height = std::max(1u, full.height * width / full.width);
+	out.buf.resize(width * height * 3);
+	out.width = width;
+	out.height = height;
+	out.ar = full.ar;
+	out.fmt = pix::RGB;
+	for (unsigned y = 0; y < height; ++y) {
+		unsigned y0 = y * full.height / height, y1 = (y + 1) * full.height / height;
+		for (unsigned x = 0; x < width; ++x) {
+			unsigned x0 = x * full.width / width, x1 = (x + 1) * full.width / width;
+			unsigned sum[3] = {};
+			for (unsigned sy = y0; sy < y1; ++sy) {
+				for (unsigned sx = x0; sx < x1; ++sx) {
+					for (unsigned c = 0; c < 3; ++c) sum[c] += full.buf[(sy * full.width + sx) * 3 + c];
+				}
+			}
+			unsigned n = (y1 - y0) * (x1 - x0);
+			for (unsigned c = 0; c < 3; ++c) out.buf[(y * width + x) * 3 + c] = (sum[c] + n / 2) / n;
+		}
+	}
+}
+
+/** Decode only the given frames (in increasing order) and write them as PNG or JPEG (by extension). **/
+static void writeThumbnails(IPUDecoder& decoder, std::vector<unsigned int> const& frames, fs::path const& outfile, unsigned width) {
+	std::string ext = outfile.extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	bool jpeg = ext == ".jpg" || ext == ".jpeg";
+	YUVFrame frame;
+	Bitmap bitmap;
+	for (std::size_t i = 0; i < frames.size(); ++i) {
+		if (frames[i] >= unsigned(decoder.frames())) throw std::runtime_error("Frame " + std::to_string(frames[i]) + " is past the end of the video");
+		decoder.seek(frames[i]);
+		decoder.decode(frame);
+		thumbnail(frame, width, bitmap);
+		fs::path name = outfile;
+		if (frames.size() > 1) {
+			std::ostringstream oss;
+			oss << outfile.stem().string() << "-" << i + 1 << outfile.extension().string();
+			name = outfile.parent_path() / oss.str();
+		}
+		if (jpeg) writeJPEG(name, bitmap); else writePNG(name, bitmap);
+	}
+}
 
 int main(int argc, char** argv) {
-	if (argc<3){
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	std::string indexfile;
+	double start = 0.0, duration = 0.0;
+	unsigned gop = 1;
+	bool yuv = false;
+	unsigned thumbnails = 0, thumbWidth = 0;
+	std::vector<double> times;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) threads = std::max(1, std::atoi(argv[++i]));
+		else if (arg.size() > 2 && arg.compare(0, 2, "-j") == 0) threads = std::max(1, std::atoi(arg.c_str() + 2));
+		else if (arg == "--index" && i + 1 < argc) indexfile = argv[++i];
+		else if (arg == "--start" && i + 1 < argc) start = std::atof(argv[++i]);
+		else if (arg == "--duration" && i + 1 < argc) duration = std::atof(argv[++i]);
+		else if (arg == "--gop" && i + 1 < argc) gop = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--yuv") yuv = true;
+		else if (arg == "--thumbnails" && i + 1 < argc) thumbnails = std::max(0, std::atoi(argv[++i]));
+		else if (arg == "--at" && i + 1 < argc) {
+			std::istringstream iss(argv[++i]);
+			for (std::string t; std::getline(iss, t, ','); ) times.push_back(std::atof(t.c_str()));
+		}
+		else if (arg == "--width" && i + 1 < argc) thumbWidth = std::max(0, std::atoi(argv[++i]));
+		else args.push_back(arg);
+	}
+	if (args.size() != 2){
 		std::printf("\nConverts an Singstar IPU-movie into an MPEG-Video\n20080103 - hawkear@gmx.de\n\n"
-			"Usage:     %s <INFILE> <OUTFILE>\n\n"
-			"Example:   %s movie.ipu myvideo.m2v\n\n",argv[0],argv[0]);
+			"Usage:     %s [-j THREADS] [--index FILE] [--start SEC] [--duration SEC] [--gop FRAMES] [--yuv] <INFILE> <OUTFILE>\n"
+			"           %s [--index FILE] [--start SEC] [--duration SEC] (--thumbnails N | --at SEC,...) [--width PX] <INFILE> <OUTFILE>\n\n"
+			"Example:   %s movie.ipu myvideo.m2v\n"
+			"           %s --thumbnails 4 --width 160 movie.ipu thumb.jpg\n\n"
+			"The index file is created if it does not exist and used for seeking to --start if it does.\n"
+			"--gop groups that many frames into each GOP (default 1, at most 1024) for a smaller file.\n"
+			"With --yuv the frames are decoded into raw I420 instead of being converted to MPEG.\n"
+			"With --thumbnails N evenly spaced frames (or with --at the frames at the given times) are decoded\n"
+			"and written as PNG or JPEG (by OUTFILE extension), numbered as thumb-1.jpg etc. if there are several.\n\n",argv[0],argv[0],argv[0],argv[0]);
 		exit(0);
 	}
-	std::vector<char> indata;
-	std::ifstream infile(argv[1], std::ios::binary);
-	infile.seekg(0, std::ios::end);
-	indata.resize(infile.tellg());
-	infile.seekg(0);
-	infile.read(&indata[0], indata.size());
+	std::ifstream infile(args[0].c_str(), std::ios::binary);
+	IPUSource source = [&infile](char* buf, std::size_t size) -> std::size_t {
+		infile.read(buf, size);
+		return infile.gcount();
+	};
 	try {
-		IPUConv(indata, argv[2]);
+		if (!infile) throw std::runtime_error("Could not open " + args[0]);
+		IPURange range = IPURange::time(start, duration);
+		IPUIndex index;
+		if (!indexfile.empty()) {
+			std::ifstream f(indexfile.c_str(), std::ios::binary);
+			if (f) index.read(f);
+			else {
+				index.build(source);
+				std::ofstream out(indexfile.c_str(), std::ios::binary);
+				index.write(out);
+			}
+			range.index = &index;
+			range.seek = [&infile](std::size_t pos) {
+				infile.clear();
+				infile.seekg(pos);
+			};
+			range.seek(0);
+		}
+		if (thumbnails || !times.empty()) {
+			// Select the frames within the whole video, the range only tells where to pick them from
+			IPURange all;
+			all.index = range.index;
+			all.seek = range.seek;
+			IPUDecoder decoder(source, all);
+			std::vector<unsigned int> frames;
+			for (double t: times) frames.push_back(IPURange::time(t, 0.0).first);
+			unsigned int first = std::min<unsigned int>(range.first, decoder.frames());
+			unsigned int count = std::min<unsigned int>(range.count ? range.count : decoder.frames(), decoder.frames() - first);
+			// Take the middle frame of each of N equal parts, avoiding the (often black) very first frame
+			for (unsigned i = 0; i < thumbnails && count; ++i) frames.push_back(first + (2 * i + 1) * count / (2 * thumbnails));
+			std::sort(frames.begin(), frames.end());
+			frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+			writeThumbnails(decoder, frames, args[1], thumbWidth);
+		} else if (yuv) {
+			std::ofstream out(args[1].c_str(), std::ios::binary);
+			if (!out) throw std::runtime_error("Could not open " + args[1]);
+			auto begin = std::chrono::steady_clock::now();
+			IPUDecoder decoder(source, range);
+			YUVFrame frame;
+			unsigned int count = 0;
+			for (; decoder.decode(frame); ++count) {
+				for (std::vector<unsigned char> const* plane: { &frame.y, &frame.u, &frame.v }) {
+					out.write(reinterpret_cast<char const*>(plane->data()), plane->size());
+				}
+			}
+			double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			std::cerr << "Decoded " << count << " frames of " << frame.width << "x" << frame.height
+			  << " in " << secs << " s (" << count / secs << " fps)" << std::endl;
+		} else {
+			IPUConv(source, args[1], true, threads, range, gop);
+		}
 	} catch (std::exception& e) {
 		std::cerr << "Error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
 	}
 }
-
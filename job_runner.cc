@@ -0,0 +1,142 @@
+#include "job_runner.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+JobRunner::JobRunner(unsigned cpus): m_cpus(std::max(cpus, 1u)), m_used(), m_running() {}
+
+JobRunner::Group JobRunner::group(std::function<void()> finish) {
+	return Group(static_cast<void*>(NULL), [finish](void*) {
+		try {
+			finish();
+		} catch (std::exception& e) {
+			std::cerr << "!!! " << e.what() << std::endl;
+		}
+	});
+}
+
+void JobRunner::run(Job const& job, Group const& group) {
+	std::lock_guard<std::mutex> l(m_mutex);
+	Entry entry = { job, group };
+	m_queue.push_back(entry);
+	startJobs();
+}
+
+void JobRunner::wait() {
+	std::unique_lock<std::mutex> l(m_mutex);
+	while (!m_queue.empty() || m_running) m_cond.wait(l);
+}
+
+void JobRunner::cancel(Group const& group) {
+	std::weak_ptr<void> g = group;
+	std::unique_lock<std::mutex> l(m_mutex);
+	auto same = [&g](Entry const& e) { return !g.owner_before(e.group) && !e.group.owner_before(g); };
+	m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(), same), m_queue.end());
+	while (m_runningGroups.count(g)) m_cond.wait(l);
+}
+
+void JobRunner::startJobs() {
+	// Called with m_mutex locked
+	while (!m_queue.empty()) {
+		// A job larger than the whole budget is run alone
+		unsigned cpus = std::min(m_queue.front().job.cpus, m_cpus);
+		if (m_used + cpus > m_cpus) break;
+		m_used += cpus;
+		++m_running;
+		m_runningGroups.insert(m_queue.front().group);
+		// Workers are not joined: each one reports its completion through m_running instead
+		std::thread(&JobRunner::execute, this, m_queue.front(), cpus).detach();
+		m_queue.pop_front();
+	}
+}
+
+void JobRunner::execute(Entry entry, unsigned cpus) {
+	bool ok = false;
+	try {
+		ok = spawn(entry.job);
+	} catch (std::exception& e) {
+		std::cerr << "!!! " << e.what() << std::endl;
+	}
+	try {
+		if (entry.job.done) entry.job.done(ok);
+	} catch (std::exception& e) {
+		std::cerr << "!!! " << e.what() << std::endl;
+	}
+	// Release the group (possibly running its finish function) before reporting completion,
+	// after which this object may be gone and must not be touched once the lock is released
+	std::weak_ptr<void> group = entry.group;
+	entry = Entry();
+	std::lock_guard<std::mutex> l(m_mutex);
+	m_used -= cpus;
+	--m_running;
+	m_runningGroups.erase(m_runningGroups.find(group));
+	startJobs();
+	m_cond.notify_all();
+}
+
+bool JobRunner::spawn(Job const& job) {
+	if (job.argv.empty()) throw std::logic_error("Empty command line");
+	std::vector<char*> argv;
+	for (auto const& arg: job.argv) argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(NULL);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	int fds[2] = { -1, -1 };
+	if (job.input) {
+		// Close-on-exec keeps other concurrently spawned programs from inheriting the pipe
+		if (pipe2(fds, O_CLOEXEC)) {
+			posix_spawn_file_actions_destroy(&actions);
+			throw std::runtime_error(job.argv[0] + ": pipe: " + std::strerror(errno));
+		}
+		posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+	}
+	pid_t pid;
+	int err = posix_spawnp(&pid, argv[0], &actions, NULL, &argv[0], environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (job.input) close(fds[0]);
+	if (err) {
+		if (job.input) close(fds[1]);
+		throw std::runtime_error(job.argv[0] + ": " + std::strerror(err));
+	}
+	if (job.input) {
+		// A program exiting early must not kill us while we are still writing to its stdin. SIGPIPE is
+		// blocked in this thread only, so that the write fails with EPIPE instead.
+		sigset_t pipeSet, oldSet;
+		sigemptyset(&pipeSet);
+		sigaddset(&pipeSet, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+		char const* data = job.input->data();
+		std::size_t left = job.input->size();
+		while (left) {
+			ssize_t ret = write(fds[1], data, left);
+			if (ret < 0 && errno == EINTR) continue;
+			if (ret < 0 && errno == EPIPE) {
+				// Consume the pending signal before unblocking it
+				timespec const zero = {};
+				sigtimedwait(&pipeSet, NULL, &zero);
+			}
+			if (ret < 0) break;  // The program quit without reading everything, its exit status tells why
+			data += ret;
+			left -= ret;
+		}
+		pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+		close(fds[1]);
+	}
+	int status;
+	while (waitpid(pid, &status, 0) < 0) if (errno != EINTR) return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
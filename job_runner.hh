@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/** An external program to be run by JobRunner. **/
+struct Job {
+	std::vector<std::string> argv;  ///< Program (looked up from PATH) followed by its arguments
+	std::shared_ptr<std::string const> input;  ///< Data piped to the program's stdin, if any
+	unsigned cpus;  ///< Number of CPUs the program is expected to keep busy
+	std::function<void(bool ok)> done;  ///< Called (from a worker thread) once the program has exited
+	Job(): cpus(1) {}
+};
+
+/**
+* Runs external programs in the background without a shell, using posix_spawn.
+* Jobs are queued and started in order as long as their CPUs fit in the budget, so that the
+* caller can continue with other work while earlier jobs are running.
+**/
+class JobRunner {
+  public:
+	/// Handle shared by related jobs, see group()
+	typedef std::shared_ptr<void> Group;
+	explicit JobRunner(unsigned cpus);
+	~JobRunner() { wait(); }
+	/// Create a group whose finish function is called once the returned handle and all jobs run with it are gone.
+	Group group(std::function<void()> finish);
+	/// Queue a job, optionally as a part of a group.
+	void run(Job const& job, Group const& group = Group());
+	/// Wait until all queued jobs have finished.
+	void wait();
+	/// Drop the queued jobs of a group and wait until its running jobs have finished.
+	void cancel(Group const& group);
+	unsigned cpus() const { return m_cpus; }
+  private:
+	struct Entry {
+		Job job;
+		Group group;
+	};
+	void startJobs();
+	void execute(Entry entry, unsigned cpus);
+	static bool spawn(Job const& job);
+	unsigned m_cpus;
+	unsigned m_used;
+	unsigned m_running;  ///< Jobs started and not yet finished (each in its own detached thread)
+	std::deque<Entry> m_queue;
+	std::multiset<std::weak_ptr<void>, std::owner_less<std::weak_ptr<void> > > m_runningGroups;  ///< Group of each running job
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+};
@@ -0,0 +1,231 @@
+#include "melody_txt.hh"
+
+#include <libxml/xmlreader.h>
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+	const unsigned NUM_SINGERS = 2;
+
+	/// Append a decimal number (without the stream and locale machinery)
+	void putInt(std::string& out, long value) {
+		char buf[24];
+		char* end = buf + sizeof(buf);
+		char* p = end;
+		unsigned long v = value < 0 ? -static_cast<unsigned long>(value) : value;
+		do { *--p = '0' + v % 10; v /= 10; } while (v);
+		if (value < 0) *--p = '-';
+		out.append(p, end);
+	}
+
+	unsigned parseUnsigned(char const* str, char const* what) {
+		if (!*str) throw std::runtime_error(std::string("Empty ") + what + " in melody XML");
+		unsigned long v = 0;
+		for (char const* p = str; *p; ++p) {
+			if (*p < '0' || *p > '9' || v > 0xFFFFFFF) throw std::runtime_error(std::string("Invalid ") + what + " in melody XML: " + str);
+			v = v * 10 + (*p - '0');
+		}
+		return v;
+	}
+
+	/// Notes of a sequence of sentences (the whole song or one track of a duet)
+	struct Part {
+		std::string notes[NUM_SINGERS];
+		bool active[NUM_SINGERS];  ///< Singers of the current sentence
+		int ts, sleepts;
+		unsigned sentences;
+		Part(): active(), ts(0), sleepts(-1), sentences() {}
+	};
+
+	class Converter {
+	  public:
+		Converter(xmlTextReaderPtr reader, bool duet): m_reader(reader), m_duet(duet), m_tracks() {
+			if (!m_reader) throw std::runtime_error("Unable to read melody XML");
+			if (!m_duet) m_top.active[0] = true;
+		}
+		~Converter() { xmlFreeTextReader(m_reader); }
+		void run(bool duetInOneFile, TxtFiles& txtFiles) {
+			parse();
+			if (!m_duet) {
+				std::cerr << "  >>> Solo track" << std::endl;
+				if (!m_top.sentences) throw std::runtime_error("Unable to find any sentences in melody XML");
+				txtFiles.push_back(std::make_pair(std::string(), std::move(m_top.notes[0])));
+				return;
+			}
+			if (!m_tracks) throw std::runtime_error("Unable to find any tracks in melody XML");
+			if (m_tracks != NUM_SINGERS) throw std::runtime_error("Invalid number of tracks");
+			std::string* notes[NUM_SINGERS];
+			// Sentences directly under the melody have singers, otherwise each track has its own
+			if (m_top.sentences) {
+				std::cerr << "  >>> Single-track duet" << std::endl;
+				for (unsigned i = 0; i < NUM_SINGERS; ++i) notes[i] = &m_top.notes[i];
+			} else {
+				std::cerr << "  >>> Double-track duet" << std::endl;
+				for (unsigned i = 0; i < NUM_SINGERS; ++i) {
+					if (!m_track[i].sentences) throw std::runtime_error("Unable to find any sentectes inside track in melody XML");
+					notes[i] = &m_track[i].notes[0];
+				}
+			}
+			if (duetInOneFile) {
+				std::string txt;
+				for (unsigned i = 0; i < NUM_SINGERS; ++i) {
+					txt += "#P";
+					putInt(txt, i + 1);
+					txt += ": " + m_singerName[i] + "\n";
+				}
+				for (unsigned i = 0; i < NUM_SINGERS; ++i) {
+					txt += "P";
+					putInt(txt, i + 1);
+					txt += "\n" + *notes[i];
+				}
+				txtFiles.push_back(std::make_pair(std::string(), std::move(txt)));
+			} else {
+				for (unsigned i = 0; i < NUM_SINGERS; ++i) {
+					txtFiles.push_back(std::make_pair(" (" + m_singerName[i] + ")", std::move(*notes[i])));
+				}
+			}
+		}
+	  private:
+		enum Kind { OTHER, MELODY, TRACK, SENTENCE, TRACK_SENTENCE };
+		/// Walk the elements, handling each as it comes by what its parent was
+		void parse() {
+			Kind kind[3] = {};
+			int ret;
+			while ((ret = xmlTextReaderRead(m_reader)) == 1) {
+				if (xmlTextReaderNodeType(m_reader) != XML_READER_TYPE_ELEMENT) continue;
+				int depth = xmlTextReaderDepth(m_reader);
+				if (depth > 3) continue;
+				char const* name = localName();
+				Kind parent = depth ? kind[depth - 1] : OTHER;
+				Kind k = OTHER;
+				if (depth == 0) {
+					if (!std::strcmp(name, "MELODY")) k = MELODY;
+				} else if (parent == MELODY && !std::strcmp(name, "TRACK")) {
+					k = TRACK;
+					track();
+				} else if (parent == MELODY && !std::strcmp(name, "SENTENCE")) {
+					k = SENTENCE;
+					sentence(m_top, m_duet);
+				} else if (parent == TRACK && !std::strcmp(name, "SENTENCE")) {
+					// Tracks only matter for duets (and any past the second are an error reported at the end)
+					if (m_duet && m_tracks <= NUM_SINGERS) {
+						k = TRACK_SENTENCE;
+						sentence(m_track[m_tracks - 1], false);
+					}
+				} else if (parent == SENTENCE && !std::strcmp(name, "NOTE")) {
+					note(m_top);
+				} else if (parent == TRACK_SENTENCE && !std::strcmp(name, "NOTE")) {
+					note(m_track[m_tracks - 1]);
+				}
+				if (depth < 3) kind[depth] = k;
+			}
+			if (ret < 0) throw std::runtime_error("Invalid melody XML");
+		}
+		void track() {
+			if (++m_tracks > NUM_SINGERS) return;
+			std::string& name = m_singerName[m_tracks - 1];
+			if (!attribute("Artist", name) && !attribute("Name", name)) throw std::runtime_error("Track without Artist");
+			m_track[m_tracks - 1].active[0] = true;
+		}
+		void sentence(Part& part, bool withSinger) {
+			++part.sentences;
+			if (withSinger && attribute("Singer", m_value)) {
+				for (unsigned i = 0; i < NUM_SINGERS; ++i) part.active[i] = false;
+				if (m_value == "Solo 1") {
+					part.active[0] = true;
+				} else if (m_value == "Solo 2") {
+					part.active[1] = true;
+				} else if (m_value == "Group") {
+					part.active[0] = true;
+					part.active[1] = true;
+				} else throw std::runtime_error("Invalid Singer");
+			}
+			if (part.sleepts != -1) part.sleepts = part.ts;
+		}
+		void note(Part& part) {
+			bool hasLyric = false, hasNote = false, hasDuration = false, rap = false, golden = false, freestyle = false;
+			unsigned note = 0, duration = 0;
+			while (xmlTextReaderMoveToNextAttribute(m_reader) == 1) {
+				char const* name = localName();
+				if (!std::strcmp(name, "Lyric")) { m_lyric = value(); hasLyric = true; }
+				else if (!std::strcmp(name, "MidiNote")) { note = parseUnsigned(value(), "MidiNote"); hasNote = true; }
+				else if (!std::strcmp(name, "Duration")) { duration = parseUnsigned(value(), "Duration"); hasDuration = true; }
+				else if (!std::strcmp(name, "Rap")) rap = true;
+				else if (!std::strcmp(name, "Bonus")) golden = true;
+				else if (!std::strcmp(name, "FreeStyle")) freestyle = true;
+			}
+			xmlTextReaderMoveToElement(m_reader);
+			if (!hasLyric || !hasNote || !hasDuration) throw std::runtime_error("Note without Lyric, MidiNote or Duration");
+			// Some extra formatting to make lyrics look better (hyphen removal & whitespace)
+			std::string& lyric = m_lyric;
+			if (lyric.size() > 0 && lyric[lyric.size() - 1] == '-') {
+				if (lyric.size() > 1 && lyric[lyric.size() - 2] == ' ') lyric.erase(lyric.size() - 2);
+				else lyric[lyric.size() - 1] = '~';
+			} else {
+				lyric += ' ';
+			}
+			char type = ':';
+			if (!rap && golden) type = '*';
+			else if (rap && !golden) type = 'R';
+			else if (rap && golden) type = 'G';
+			else if (freestyle) type = 'F';
+			std::string& line = m_value;
+			line.clear();
+			if (note) {
+				if (part.sleepts > 0) {
+					line += "- ";
+					putInt(line, part.sleepts);
+					line += '\n';
+				}
+				part.sleepts = 0;
+				line += type;
+				line += ' ';
+				putInt(line, part.ts);
+				line += ' ';
+				putInt(line, duration);
+				line += ' ';
+				putInt(line, note);
+				line += ' ';
+				line += lyric;
+				line += '\n';
+			}
+			part.ts += duration;
+			bool written = false;
+			for (unsigned i = 0; i < NUM_SINGERS; ++i) {
+				if (part.active[i]) {
+					part.notes[i] += line;
+					written = true;
+				}
+			}
+			if (!written) throw std::runtime_error("No singer for note");
+		}
+		/// Get an attribute of the current element, returns false if it does not have it
+		bool attribute(char const* name, std::string& result) {
+			if (xmlTextReaderMoveToAttribute(m_reader, reinterpret_cast<xmlChar const*>(name)) != 1) return false;
+			result = value();
+			xmlTextReaderMoveToElement(m_reader);
+			return true;
+		}
+		char const* localName() {
+			return reinterpret_cast<char const*>(xmlTextReaderConstLocalName(m_reader));
+		}
+		/// Value of the current attribute, only valid until the reader moves on
+		char const* value() {
+			xmlChar const* v = xmlTextReaderConstValue(m_reader);
+			return v ? reinterpret_cast<char const*>(v) : "";
+		}
+		xmlTextReaderPtr m_reader;
+		bool m_duet;
+		unsigned m_tracks;  ///< TRACK elements seen so far
+		Part m_top;  ///< Sentences directly under MELODY
+		Part m_track[NUM_SINGERS];  ///< Sentences of each track (only the first singer of each is used)
+		std::string m_singerName[NUM_SINGERS];
+		std::string m_lyric, m_value;  ///< Reused to avoid allocating for every note
+	};
+}
+
+void melodyToTxt(xmlDoc* doc, bool duet, bool duetInOneFile, TxtFiles& txtFiles) {
+	Converter(xmlReaderWalker(doc), duet).run(duetInOneFile, txtFiles);
+}
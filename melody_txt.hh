@@ -0,0 +1,16 @@
+#pragma once
+
+#include <libxml/tree.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Contents of notes*.txt files below the song header, by filename suffix
+typedef std::vector<std::pair<std::string, std::string> > TxtFiles;
+
+/** Convert a parsed SingStar melody into UltraStar notes in a single pass over its nodes with libxml's
+* xmlTextReader walker, without XPath queries or per-note allocations. Duets go into one file with both
+* singers (duetInOneFile) or into one file per singer, suffixed by the singer's name.
+**/
+void melodyToTxt(xmlDoc* doc, bool duet, bool duetInOneFile, TxtFiles& txtFiles);
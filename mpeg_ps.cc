@@ -0,0 +1,144 @@
+#include "mpeg_ps.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+	const uint64_t CLOCK = 90000;  // System clock for PTS and SCR
+	const uint64_t PRELOAD = CLOCK / 2;  // Delay of the first presentation after the first pack
+	const unsigned MUX_RATE = 25200;  // In units of 50 bytes/s (10.08 Mbit/s, as on DVDs)
+	const std::size_t MAX_PAYLOAD = 2016;  // Payload of a PES packet, keeping packs at about 2 KiB
+	const unsigned char VIDEO_ID = 0xE0;
+	const unsigned char PRIVATE1_ID = 0xBD;
+	const unsigned char LPCM_ID = 0xA0;  // Substream of private stream 1
+
+	void putTimestamp(std::vector<unsigned char>& buf, unsigned char prefix, uint64_t ts) {
+		buf.push_back(prefix << 4 | (ts >> 29 & 0x0E) | 1);
+		buf.push_back(ts >> 22);
+		buf.push_back((ts >> 14 & 0xFE) | 1);
+		buf.push_back(ts >> 7);
+		buf.push_back((ts << 1 & 0xFE) | 1);
+	}
+	void putStartCode(std::vector<unsigned char>& buf, unsigned char code) {
+		unsigned char sc[] = { 0, 0, 1, code };
+		buf.insert(buf.end(), sc, sc + 4);
+	}
+}
+
+PSMux::PSMux(std::string const& filename, double fps, unsigned sampleRate, unsigned channels):
+  m_file(filename.c_str(), std::ios::binary), m_fps(fps), m_sampleRate(sampleRate), m_channels(channels),
+  m_pictures(), m_samples(), m_scr(), m_systemHeader(), m_finished()
+{
+	if (!m_file) throw std::runtime_error("Could not open " + filename);
+	if (sampleRate && sampleRate != 48000 && sampleRate != 96000 && sampleRate != 44100 && sampleRate != 32000) {
+		throw std::runtime_error("Sample rate not supported by LPCM: " + std::to_string(sampleRate));
+	}
+	if (sampleRate && (channels < 1 || channels > 8)) throw std::runtime_error("Too many channels for LPCM");
+}
+
+PSMux::~PSMux() {
+	try { finish(); } catch (...) {}
+}
+
+void PSMux::video(char const* data, std::size_t size) {
+	uint64_t pts = PRELOAD + uint64_t(m_pictures * CLOCK / m_fps + 0.5);
+	for (std::size_t pos = 0; pos < size || pos == 0; pos += MAX_PAYLOAD) {
+		pack(pts - PRELOAD);
+		// Only the packet where the picture starts carries its time stamp
+		pes(VIDEO_ID, pts, pos == 0, std::vector<unsigned char>(), data + pos, std::min(MAX_PAYLOAD, size - pos));
+		if (!size) break;
+	}
+	++m_pictures;
+}
+
+void PSMux::audio(short const* pcm, std::size_t frames) {
+	if (!m_sampleRate) return;
+	// 10 ms per packet keeps the payload under MAX_PAYLOAD for stereo at up to 48 kHz
+	std::size_t packet = std::max<std::size_t>(1, std::min<std::size_t>(m_sampleRate / 100, (MAX_PAYLOAD - 7) / (2 * m_channels)));
+	m_pending.insert(m_pending.end(), pcm, pcm + frames * m_channels);
+	std::size_t pos = 0;
+	for (; m_pending.size() - pos >= packet * m_channels; pos += packet * m_channels) writeAudio(&m_pending[pos], packet);
+	m_pending.erase(m_pending.begin(), m_pending.begin() + pos);
+}
+
+void PSMux::finish() {
+	if (m_finished) return;
+	m_finished = true;
+	if (!m_pending.empty()) writeAudio(&m_pending[0], m_pending.size() / m_channels);
+	m_pending.clear();
+	m_buf.clear();
+	putStartCode(m_buf, 0xB9);  // Program end
+	m_file.write(reinterpret_cast<char const*>(&m_buf[0]), m_buf.size());
+	m_file.close();
+	if (!m_file) throw std::runtime_error("Writing the program stream failed");
+}
+
+void PSMux::writeAudio(short const* pcm, std::size_t frames) {
+	uint64_t pts = PRELOAD + m_samples * CLOCK / m_sampleRate;
+	unsigned rate = m_sampleRate == 96000 ? 1 : m_sampleRate == 44100 ? 2 : m_sampleRate == 32000 ? 3 : 0;
+	// Substream, frame count, first access unit pointer, frame number, 16 bit/rate/channels, dynamic range
+	unsigned char header[] = { LPCM_ID, 0x07, 0x00, 0x04, 0x0C, static_cast<unsigned char>(rate << 4 | (m_channels - 1)), 0x80 };
+	std::vector<char> data(frames * m_channels * 2);
+	for (std::size_t i = 0; i < frames * m_channels; ++i) {
+		data[2 * i] = pcm[i] >> 8;  // LPCM is big endian
+		data[2 * i + 1] = pcm[i];
+	}
+	pack(pts - PRELOAD);
+	pes(PRIVATE1_ID, pts, true, std::vector<unsigned char>(header, header + sizeof(header)), data.data(), data.size());
+	m_samples += frames;
+}
+
+void PSMux::pack(uint64_t scr) {
+	// The clock must not go backwards and cannot be faster than the mux rate allows
+	m_scr = std::max(scr, m_scr);
+	m_buf.clear();
+	putStartCode(m_buf, 0xBA);
+	m_buf.push_back(0x44 | (m_scr >> 27 & 0x38) | (m_scr >> 28 & 0x03));
+	m_buf.push_back(m_scr >> 20);
+	m_buf.push_back(0x04 | (m_scr >> 12 & 0xF8) | (m_scr >> 13 & 0x03));
+	m_buf.push_back(m_scr >> 5);
+	m_buf.push_back(0x04 | (m_scr << 3 & 0xF8));  // Followed by the SCR extension, always zero
+	m_buf.push_back(0x01);
+	m_buf.push_back(MUX_RATE >> 14);
+	m_buf.push_back(MUX_RATE >> 6 & 0xFF);
+	m_buf.push_back((MUX_RATE << 2 & 0xFC) | 0x03);
+	m_buf.push_back(0xF8);  // No stuffing
+	if (!m_systemHeader) {
+		m_systemHeader = true;
+		unsigned streams = m_sampleRate ? 2 : 1;
+		putStartCode(m_buf, 0xBB);
+		m_buf.push_back(0);
+		m_buf.push_back(6 + 3 * streams);
+		m_buf.push_back(0x80 | MUX_RATE >> 15);
+		m_buf.push_back(MUX_RATE >> 7 & 0xFF);
+		m_buf.push_back((MUX_RATE << 1 & 0xFE) | 1);
+		m_buf.push_back((streams - 1) << 2);  // Audio bound, variable rate, not constrained
+		m_buf.push_back(0xE1);  // Audio and video locked to the system clock, video bound 1
+		m_buf.push_back(0x7F);
+		// Stream buffer bounds: video 232 KiB (scale 1, units of 1024 bytes), audio 8 KiB (scale 0, units of 128 bytes)
+		unsigned char video[] = { VIDEO_ID, 0xE0, 232 };
+		m_buf.insert(m_buf.end(), video, video + 3);
+		if (m_sampleRate) {
+			unsigned char audio[] = { PRIVATE1_ID, 0xC0, 64 };
+			m_buf.insert(m_buf.end(), audio, audio + 3);
+		}
+	}
+	m_file.write(reinterpret_cast<char const*>(&m_buf[0]), m_buf.size());
+}
+
+void PSMux::pes(unsigned char streamId, uint64_t pts, bool hasPts, std::vector<unsigned char> const& header, char const* data, std::size_t size) {
+	m_buf.clear();
+	putStartCode(m_buf, streamId);
+	std::size_t length = 3 + (hasPts ? 5 : 0) + header.size() + size;
+	m_buf.push_back(length >> 8);
+	m_buf.push_back(length);
+	m_buf.push_back(0x81);  // Not scrambled, original
+	m_buf.push_back(hasPts ? 0x80 : 0x00);
+	m_buf.push_back(hasPts ? 5 : 0);
+	if (hasPts) putTimestamp(m_buf, 0x2, pts);
+	m_buf.insert(m_buf.end(), header.begin(), header.end());
+	m_file.write(reinterpret_cast<char const*>(&m_buf[0]), m_buf.size());
+	m_file.write(data, size);
+	// Advance the clock by the time the pack takes at the mux rate
+	m_scr += (14 + m_buf.size() + size) * CLOCK / (50 * MUX_RATE);
+}
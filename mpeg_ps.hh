@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/** MPEG-2 program stream writer for one intra coded video stream and one 16-bit LPCM audio stream.
+* Pictures and audio are written as they are passed in, so the caller should interleave them
+* in time (e.g. add the audio up to the end of each picture before the picture itself).
+**/
+class PSMux {
+  public:
+	/// Audio may be left out by passing sampleRate 0
+	PSMux(std::string const& filename, double fps, unsigned sampleRate, unsigned channels = 2);
+	~PSMux();
+	/// Add one coded picture (with any headers before it); pictures are presented at the frame rate
+	void video(char const* data, std::size_t size);
+	/// Add interleaved PCM samples
+	void audio(short const* pcm, std::size_t frames);
+	/// Write out buffered audio and the end code
+	void finish();
+	/// Time of the next picture in seconds
+	double videoTime() const { return m_pictures / m_fps; }
+  private:
+	void pack(uint64_t scr);
+	void pes(unsigned char streamId, uint64_t pts, bool hasPts, std::vector<unsigned char> const& header, char const* data, std::size_t size);
+	void writeAudio(short const* pcm, std::size_t frames);
+	std::ofstream m_file;
+	double m_fps;
+	unsigned m_sampleRate, m_channels;
+	uint64_t m_pictures, m_samples;  ///< Pictures and audio frames written so far
+	uint64_t m_scr;
+	bool m_systemHeader;  ///< Has the system header been written
+	bool m_finished;
+	std::vector<short> m_pending;  ///< Audio not yet making up a full packet
+	std::vector<unsigned char> m_buf;
+};
@@ -125,3 +125,28 @@ PakFile const& Pak::operator[](std::string const& filename) const {
 	return r->second;
 }
 
+
+PakReader::PakReader(PakFile const& file, unsigned int pos): m_file(file), m_pos(), m_size(file.size) {
+	if (file.zlibmode) {
+		file.get(m_inflated);
+		m_size = m_inflated.size();
+	} else {
+		m_stream.open(file.pakname.c_str(), std::ios::binary);
+		if (!m_stream.is_open()) throw std::runtime_error("Could not open PAK file " + file.pakname);
+	}
+	seek(pos);
+}
+
+void PakReader::seek(unsigned int pos) {
+	if (pos > m_size) throw std::logic_error("Trying to seek past end of file");
+	m_pos = pos;
+	if (!m_file.zlibmode) m_stream.seekg(m_file.offset + pos);
+}
+
+unsigned int PakReader::read(char* buf, unsigned int s) {
+	s = std::min(s, m_size - m_pos);
+	if (m_file.zlibmode) std::copy(m_inflated.begin() + m_pos, m_inflated.begin() + m_pos + s, buf);
+	else if (!m_stream.read(buf, s)) throw std::runtime_error("Reading " + m_file.pakname + " failed");
+	m_pos += s;
+	return s;
+}
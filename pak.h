@@ -39,6 +39,23 @@ struct PakFile {
 	}
 };
 
+/** Sequential reader that keeps the archive open, for streaming a file in pieces. **/
+class PakReader {
+  public:
+	PakReader(PakFile const& file, unsigned int pos = 0);
+	/// Read up to s bytes, returning the number of bytes read (less than s only at end of file).
+	unsigned int read(char* buf, unsigned int s);
+	void seek(unsigned int pos);
+	unsigned int tell() const { return m_pos; }
+	unsigned int size() const { return m_size; }
+  private:
+	PakFile const& m_file;
+	std::ifstream m_stream;
+	std::vector<char> m_inflated;  // Whole contents, for zlib deflated files that cannot be streamed
+	unsigned int m_pos;
+	unsigned int m_size;
+};
+
 class Pak {
   public:
 	typedef std::map<std::string, PakFile> files_t;
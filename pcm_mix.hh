@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** Mix two buffers of 16-bit PCM into out at half gain each, like sox -m does, so that the sum cannot clip.
+* The average is rounded half up; flipping the sign bits lets SSE2's unsigned average handle signed samples.
+**/
+inline void mixAverage(short const* a, short const* b, short* out, std::size_t n) {
+	std::size_t i = 0;
+#ifdef __SSE2__
+	__m128i const sign = _mm_set1_epi16(-0x8000);
+	for (; i + 8 <= n; i += 8) {
+		__m128i va = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i)), sign);
+		__m128i vb = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i)), sign);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(_mm_avg_epu16(va, vb), sign));
+	}
+#endif
+	for (; i < n; ++i) out[i] = (a[i] + b[i] + 1) >> 1;
+}
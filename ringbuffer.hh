@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+* Wait-free single-producer single-consumer ring buffer.
+* One thread may write() and another read() concurrently without locks or allocations,
+* making it suitable for feeding real-time audio callbacks.
+**/
+template <typename T> class RingBuffer {
+  public:
+	/// Capacity is rounded up to a power of two
+	explicit RingBuffer(std::size_t capacity): m_read(), m_write() {
+		std::size_t size = 1;
+		while (size < capacity) size <<= 1;
+		m_buf.resize(size);
+	}
+	/// Write up to n items, returning the number actually written (limited by free space).
+	std::size_t write(T const* data, std::size_t n) {
+		std::size_t w = m_write.load(std::memory_order_relaxed);
+		std::size_t r = m_read.load(std::memory_order_acquire);
+		n = std::min(n, m_buf.size() - (w - r));
+		copy(data, data + n, w);
+		m_write.store(w + n, std::memory_order_release);
+		return n;
+	}
+	/// Read up to n items, returning the number actually read (limited by available data).
+	std::size_t read(T* data, std::size_t n) {
+		std::size_t r = m_read.load(std::memory_order_relaxed);
+		std::size_t w = m_write.load(std::memory_order_acquire);
+		n = std::min(n, w - r);
+		std::size_t pos = r & (m_buf.size() - 1);
+		std::size_t first = std::min(n, m_buf.size() - pos);
+		std::copy(m_buf.begin() + pos, m_buf.begin() + pos + first, data);
+		std::copy(m_buf.begin(), m_buf.begin() + (n - first), data + first);
+		m_read.store(r + n, std::memory_order_release);
+		return n;
+	}
+	/// Number of items available for reading (approximate while the other thread is active)
+	std::size_t size() const { return m_write.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire); }
+	std::size_t capacity() const { return m_buf.size(); }
+  private:
+	void copy(T const* begin, T const* end, std::size_t w) {
+		std::size_t pos = w & (m_buf.size() - 1);
+		std::size_t first = std::min<std::size_t>(end - begin, m_buf.size() - pos);
+		std::copy(begin, begin + first, m_buf.begin() + pos);
+		std::copy(begin + first, end, m_buf.begin());
+	}
+	std::vector<T> m_buf;
+	// Monotonic counters; their difference is the fill level
+	std::atomic<std::size_t> m_read;
+	std::atomic<std::size_t> m_write;
+};
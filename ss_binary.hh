@@ -1,5 +1,6 @@
 #include "adpcm.h"
 #include "ipuconv.hh"
+#include "pcm_mix.hh"
 
 unsigned getLE16(char* buf) { unsigned char* b = reinterpret_cast<unsigned char*>(buf); return b[0] | (b[1] << 8); }
 unsigned getLE32(char* buf) { unsigned char* b = reinterpret_cast<unsigned char*>(buf); return b[0] | (b[1] << 8) | (b[2] << 16) | (b[3] << 24); }
@@ -22,165 +23,157 @@ void writeWavHeader(std::ostream& outfile, unsigned ch, unsigned sr, unsigned sa
 	{ int   tmp = datasize; outfile.write((char*)(&tmp),4); }
 }
 
-void writeMusic(fs::path const& filename, std::vector<short> const& buf, unsigned sr) {
-	std::ofstream f(filename.string().c_str(), std::ios::binary);
+void writeMusic(std::ostream& f, std::vector<short> const& buf, unsigned sr) {
 	writeWavHeader(f, 2, sr, buf.size());
 	f.write(reinterpret_cast<char const*>(&buf[0]), buf.size() * sizeof(short));
 }
 
-void video_us(Song& song, PakFile const& iavFile, PakFile const& indFile, fs::path const& outPath) {
-	// Tracks on my example
-	// 0 => video (ipu)
-	// 1 and 2 => adpcm song (left/right)
-	// 3 and 4 => adpcm vocals (left/right)
+void writeMusic(fs::path const& filename, std::vector<short> const& buf, unsigned sr) {
+	std::ofstream f(filename.string().c_str(), std::ios::binary);
+	writeMusic(f, buf, sr);
+}
 
-	std::vector<char> ipudata;
-	std::vector<char> data;
-	std::vector<char> ind_file;
-	indFile.get(ind_file);
+/** Decoded song audio: music (or instrumental if karaoke) in pcm[0] and vocals in pcm[1], both interleaved stereo.
+* For karaoke songs the two are mixed (averaged like sox -m) in the same pass, providing the music track;
+* mix stays empty for songs without vocals. **/
+struct SongAudio {
+	unsigned sr;
+	std::vector<short> pcm[2];
+	std::vector<short> mix;
+	bool karaoke;
+	SongAudio(): sr(), karaoke() {}
+	/** Append a chunk decoded from four channels (music/instrumental L/R, vocals L/R). **/
+	void append(std::vector<short> const& pcm4ch) {
+		for (size_t s = 0; s < pcm4ch.size(); s += 4) {
+			short l1 = pcm4ch[s];
+			short r1 = pcm4ch[s + 1];
+			short l2 = pcm4ch[s + 2];
+			short r2 = pcm4ch[s + 3];
+			pcm[0].push_back(l1);
+			pcm[0].push_back(r1);
+			pcm[1].push_back(l2);
+			pcm[1].push_back(r2);
+			if (l2 != 0 || r2 != 0) karaoke = true;
+		}
+		if (!karaoke) return;
+		// Everything not mixed yet, i.e. all the audio so far on the first chunk with vocals
+		std::size_t begin = mix.size();
+		mix.resize(pcm[0].size());
+		mixAverage(pcm[0].data() + begin, pcm[1].data() + begin, mix.data() + begin, mix.size() - begin);
+	}
+};
 
-	unsigned int iav_offset = 0;
-	unsigned int frame = 0;
-	for( unsigned int ind_offset = 0x68 ; ind_offset < ind_file.size() ; ind_offset+=2) {
-		unsigned int size = getLE16(&ind_file[ind_offset]) << 4;
-		switch(frame % 5) {
-		case 0:
-			// first 4 bytes are packet length
-			iavFile.get(data, iav_offset, size);
-			{
-				unsigned int consumed = 0;
-				while(consumed < size) {
-					unsigned int opaque_footer_size = 3 * sizeof(int);
-					unsigned int chunk = getLE32(&data[consumed]);
-					ipudata.insert(ipudata.end(), data.begin() + 4 + consumed, data.begin() + consumed + chunk - opaque_footer_size);
-					consumed += chunk;
-				}
+/** Demuxes an IAV file (US discs) in a single sequential pass, decoding the ADPCM audio (if requested)
+* as it goes. The video is served on demand as an IPUSource, one packet at a time; demux() skips it.
+**/
+class IavDemuxer {
+  public:
+	IavDemuxer(PakFile const& iavFile, PakFile const& indFile, SongAudio* audio = NULL):
+	  m_iav(iavFile), m_audio(audio), m_adpcm(0, decodeChannels), m_ind_offset(0x68), m_track(), m_audioSize(), m_pos()
+	{
+		indFile.get(m_ind);
+		if (m_ind.size() < 0x68) throw std::runtime_error("IAV index is truncated");
+		if (m_audio) m_audio->sr = getLE32(&m_ind[0x60]);
+	}
+	/// Read video data, demuxing as far as needed
+	std::size_t operator()(char* buf, std::size_t size) {
+		std::size_t got = 0;
+		while (got < size) {
+			if (m_pos == m_packet.size()) {
+				m_packet.clear();
+				m_pos = 0;
+				if (!next()) break;
+				continue;
 			}
-			iav_offset += size;
-			break;
-		case 1:
-		case 2:
-		case 3:
-		case 4:
-			// audio
-			iav_offset += size;
-			break;
+			std::size_t n = std::min(size - got, m_packet.size() - m_pos);
+			std::copy(m_packet.begin() + m_pos, m_packet.begin() + m_pos + n, buf + got);
+			m_pos += n;
+			got += n;
 		}
-		frame++;
+		return got;
 	}
-
-	IPUConv(ipudata, (outPath / "video.mpg").string(), song.pal);
-	song.video = outPath / "video.mpg";
-}
-
-void music_us(Song& song, PakFile const& iavFile, PakFile const& indFile, fs::path const& outPath) {
-	// Tracks on my example
-	// 0 => video (ipu)
-	// 1 and 2 => adpcm song (left/right)
-	// 3 and 4 => adpcm vocals (left/right)
-	// std::cout << "  >>> IAV file size: " << iavFile.size << std::endl;
-	// std::cout << "  >>> IND file size: " << indFile.size << std::endl;
-
-	std::vector<char> ind_file;
-	indFile.get(ind_file);
-	unsigned int sr = getLE32(&ind_file[0x60]);
-	// std::cout << "  >>> sample rate: " << sr << std::endl;
-
-	const unsigned decodeChannels = 4; // Do not change!
-	Adpcm adpcm(0, decodeChannels);
-	std::vector<short> pcm[2];
-
-	bool karaoke = false;
-	unsigned int iav_offset = 0;
-	unsigned int frame = 0;
-	unsigned int video_size, audio_size = 0;
-	for( unsigned int ind_offset = 0x68 ; ind_offset < ind_file.size() ; ind_offset+=2) {
-		unsigned int size = getLE16(&ind_file[ind_offset]) << 4;
-		switch(frame%5) {
-			case 0:
-				video_size = size;
-				iav_offset += video_size;
-				break;
-			case 1:
-				// song left
-				audio_size = size;
-				break;
-			case 2:
-				// song right
-				audio_size += size;
-				break;
-			case 3:
-				// vocals left
-				audio_size += size;
-				break;
-			case 4:
-				// vocals right
-				audio_size += size;
-				adpcm.interleave(size);
-				for (unsigned pos = 0, end; (end = pos + 2 * adpcm.chunkBytes()) <= audio_size; pos = end) {
-					std::vector<char> data;
-					iavFile.get(data, iav_offset + pos, end - pos);
-					std::vector<short> pcmtmp(adpcm.chunkFrames() * decodeChannels);
-					adpcm.decodeChunk(&data[0], pcmtmp.begin());
-					for (size_t s = 0; s < pcmtmp.size(); s += 4) {
-						short l1 = pcmtmp[s];
-						short r1 = pcmtmp[s + 1];
-						short l2 = pcmtmp[s + 2];
-						short r2 = pcmtmp[s + 3];
-						pcm[0].push_back(l1);
-						pcm[0].push_back(r1);
-						pcm[1].push_back(l2);
-						pcm[1].push_back(r2);
-						if (l2 != 0 || r2 != 0) karaoke = true;
-					}
-				}
-				iav_offset += audio_size;
-				break;
+	/// Demux the rest of the file, decoding only the audio
+	void demux() {
+		m_packet.clear();
+		m_pos = 0;
+		while (next(true)) {}
+	}
+  private:
+	static const unsigned decodeChannels = 4; // Do not change!
+	/// Process the packet of the next index entry, returns false at end of file
+	bool next(bool skipVideo = false) {
+		// Tracks on my example
+		// 0 => video (ipu)
+		// 1 and 2 => adpcm song (left/right)
+		// 3 and 4 => adpcm vocals (left/right)
+		if (m_ind_offset + 2 > m_ind.size()) return false;
+		unsigned int size = getLE16(&m_ind[m_ind_offset]) << 4;
+		unsigned int track = m_track % 5;
+		m_ind_offset += 2;
+		++m_track;
+		if (track == 0) {
+			if (skipVideo) m_iav.seek(m_iav.tell() + size); else video(size);
+			return true;
+		}
+		// The four audio packets follow each other and are decoded together
+		m_audioSize = track == 1 ? size : m_audioSize + size;
+		if (track != 4) return true;
+		if (!m_audio) {
+			m_iav.seek(m_iav.tell() + m_audioSize);
+			return true;
 		}
-		frame++;
+		read(m_audioSize);
+		m_adpcm.interleave(size);
+		m_pcm.resize(m_adpcm.chunkFrames() * decodeChannels);
+		for (unsigned pos = 0, end; (end = pos + 2 * m_adpcm.chunkBytes()) <= m_audioSize; pos = end) {
+			m_adpcm.decodeChunk(&m_data[pos], m_pcm.begin());
+			m_audio->append(m_pcm);
+		}
+		return true;
 	}
-	std::string ext;
-
-	if (karaoke) {
-		writeMusic(song.instrumental = outPath / ("instrumental.wav"), pcm[0], sr);
-		writeMusic(song.vocals = outPath / ("vocals.wav"), pcm[1], sr);
-	} else {
-		writeMusic(song.music = outPath / ("music.wav"), pcm[0], sr);
+	/// Append the IPU data of a video packet to m_packet
+	void video(unsigned int size) {
+		read(size);
+		// The packet is made of chunks, each starting with its length and ending in an opaque footer
+		const unsigned int opaque_footer_size = 3 * sizeof(int);
+		for (unsigned int consumed = 0; consumed < size; ) {
+			if (size - consumed < 4) throw std::runtime_error("Invalid IAV video packet");
+			unsigned int chunk = getLE32(&m_data[consumed]);
+			if (chunk < 4 + opaque_footer_size || chunk > size - consumed) throw std::runtime_error("Invalid IAV video packet");
+			m_packet.insert(m_packet.end(), m_data.begin() + consumed + 4, m_data.begin() + consumed + chunk - opaque_footer_size);
+			consumed += chunk;
+		}
 	}
-}
+	void read(unsigned int size) {
+		m_data.resize(size);
+		if (m_iav.read(m_data.data(), size) != size) throw std::runtime_error("IAV file is truncated");
+	}
+	PakReader m_iav;
+	SongAudio* m_audio;
+	Adpcm m_adpcm;
+	std::vector<char> m_ind;
+	unsigned int m_ind_offset;
+	unsigned int m_track;  // Number of index entries processed
+	unsigned int m_audioSize;  // Size of the audio packets of the current frame so far
+	std::vector<char> m_data;  // Packet being processed
+	std::vector<short> m_pcm;
+	std::vector<char> m_packet;  // Video not yet read through operator()
+	std::size_t m_pos;  // Position in m_packet
+};
 
-void music(Song& song, PakFile const& dataFile, PakFile const& headerFile, fs::path const& outPath) {
+void music(SongAudio& audio, PakFile const& dataFile, PakFile const& headerFile, AdpcmIndex* index = NULL) {
 	std::vector<char> data;
 	headerFile.get(data);
-	unsigned sr = getLE16(&data[12]);
+	audio.sr = getLE16(&data[12]);
 	unsigned interleave = getLE16(&data[16]);
 	const unsigned decodeChannels = 4; // Do not change!
 	Adpcm adpcm(interleave, decodeChannels);
-	std::vector<short> pcm[2];
-	bool karaoke = false;
 	for (unsigned pos = 0, end; (end = pos + 2 * adpcm.chunkBytes()) <= dataFile.size; pos = end) {
 		dataFile.get(data, pos, end - pos);
+		if (index) index->add(adpcm, pos, audio.pcm[0].size() / 2);
 		std::vector<short> pcmtmp(adpcm.chunkFrames() * decodeChannels);
 		adpcm.decodeChunk(&data[0], pcmtmp.begin());
-		for (size_t s = 0; s < pcmtmp.size(); s += 4) {
-			short l1 = pcmtmp[s];
-			short r1 = pcmtmp[s + 1];
-			short l2 = pcmtmp[s + 2];
-			short r2 = pcmtmp[s + 3];
-			pcm[0].push_back(l1);
-			pcm[0].push_back(r1);
-			pcm[1].push_back(l2);
-			pcm[1].push_back(r2);
-			if (l2 != 0 || r2 != 0) karaoke = true;
-		}
-	}
-	std::string ext;
-
-	if (karaoke) {
-		writeMusic(song.instrumental = outPath / ("instrumental.wav"), pcm[0], sr);
-		writeMusic(song.vocals = outPath / ("vocals.wav"), pcm[1], sr);
-	} else {
-		writeMusic(song.music = outPath / ("music.wav"), pcm[0], sr);
+		audio.append(pcmtmp);
 	}
 }
 
@@ -0,0 +1,131 @@
+/// @file Song catalog of a disc, cached between runs of ss_extract.
+
+#include <boost/crc.hpp>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+/** What ss_extract finds in the XML files of a disc before extracting anything. **/
+struct Catalog {
+	std::string productCode;
+	std::string keys[4];  ///< CHC keys (PRODUCT_NAME, PRODUCT_CODE, TERRITORY, DEFAULT_LANG)
+	std::string edition, language;
+	std::map<std::string, Song> songs;  ///< By song ID
+
+	/** Write the catalog, with the stamp of the disc it was made from. Only the fields read
+	* from the XML files are stored; data paks are stored by filename, without the DVD path.
+	**/
+	void write(std::ostream& os, std::string const& stamp) const {
+		os.write("SSCC", 4);
+		putLE(os, 1);  // Version
+		putString(os, stamp);
+		putString(os, productCode);
+		for (auto const& key: keys) putString(os, key);
+		putString(os, edition);
+		putString(os, language);
+		putLE(os, songs.size());
+		for (auto const& p: songs) {
+			Song const& s = p.second;
+			putString(os, p.first);
+			putString(os, filename(s.dataPakName));
+			putString(os, s.melody);
+			putString(os, s.title);
+			putString(os, s.artist);
+			putString(os, s.genre);
+			putString(os, s.year);
+			putDouble(os, s.fps);
+			putLE(os, s.pal);
+			putDouble(os, s.medleyStart);
+			putDouble(os, s.medleyEnd);
+		}
+	}
+
+	/** Read a catalog written by write(). Returns false if it is not valid or was made from a different disc. **/
+	bool read(std::istream& is, std::string const& stamp, fs::path const& dvd) {
+		char magic[4];
+		is.read(magic, 4);
+		if (!is || std::string(magic, 4) != "SSCC" || getLE(is) != 1 || getString(is) != stamp) return false;
+		Catalog c;
+		c.productCode = getString(is);
+		for (auto& key: c.keys) key = getString(is);
+		c.edition = getString(is);
+		c.language = getString(is);
+		for (unsigned n = getLE(is); is && n; --n) {
+			std::string id = getString(is);
+			Song& s = c.songs[id];
+			s.dataPakName = (dvd / getString(is)).string();
+			s.melody = getString(is);
+			s.title = getString(is);
+			s.artist = getString(is);
+			s.genre = getString(is);
+			s.year = getString(is);
+			s.fps = getDouble(is);
+			s.pal = getLE(is);
+			s.medleyStart = getDouble(is);
+			s.medleyEnd = getDouble(is);
+			s.edition = c.edition;
+		}
+		if (!is) return false;
+		*this = std::move(c);
+		return true;
+	}
+
+	/** Identify the disc by the names, sizes and modification times of its pak files. **/
+	static std::string stamp(fs::path const& dvd) {
+		std::vector<std::string> files;
+		for (fs::directory_iterator it(dvd), end; it != end; ++it) {
+			std::string name = filename(it->path());
+			if (name != "pack_ee.pak" && (name.substr(0, 7) != "pak_iop" || it->path().extension() != ".pak")) continue;
+			std::ostringstream oss;
+			oss << name << ' ' << fs::file_size(it->path()) << ' ' << fs::last_write_time(it->path()) << '\n';
+			files.push_back(oss.str());
+		}
+		std::sort(files.begin(), files.end());  // The directory order is unspecified
+		std::string ret;
+		for (auto const& f: files) ret += f;
+		return ret;
+	}
+
+	/** Cache file for the given stamp in the cache directory. **/
+	static fs::path file(fs::path const& dir, std::string const& stamp) {
+		boost::crc_32_type crc;
+		crc.process_bytes(stamp.data(), stamp.size());
+		std::ostringstream oss;
+		oss << "catalog-" << std::hex << std::setw(8) << std::setfill('0') << crc.checksum() << ".bin";
+		return dir / oss.str();
+	}
+
+  private:
+	static void putLE(std::ostream& os, unsigned int val) {
+		for (unsigned i = 0; i < 4; ++i) os.put(static_cast<char>(val >> i * 8));
+	}
+	static unsigned int getLE(std::istream& is) {
+		unsigned int val = 0;
+		for (unsigned i = 0; i < 4; ++i) val |= static_cast<unsigned int>(static_cast<unsigned char>(is.get())) << i * 8;
+		return val;
+	}
+	static void putString(std::ostream& os, std::string const& str) {
+		putLE(os, str.size());
+		os.write(str.data(), str.size());
+	}
+	static std::string getString(std::istream& is) {
+		unsigned int size = getLE(is);
+		if (!is || size > 1 << 20) { is.setstate(std::ios::failbit); return std::string(); }
+		std::string str(size, '\0');
+		is.read(&str[0], size);
+		return str;
+	}
+	static void putDouble(std::ostream& os, double val) {
+		uint64_t bits;
+		std::memcpy(&bits, &val, sizeof(bits));
+		putLE(os, bits);
+		putLE(os, bits >> 32);
+	}
+	static double getDouble(std::istream& is) {
+		uint64_t bits = getLE(is);
+		bits |= uint64_t(getLE(is)) << 32;
+		double val;
+		std::memcpy(&val, &bits, sizeof(val));
+		return val;
+	}
+};
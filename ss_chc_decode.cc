@@ -1,38 +1,114 @@
 #include <cstdlib>
 #include "chc_decode.hh"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <random>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <iterator>
+#include <vector>
+#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
+namespace fs = boost::filesystem;
+
+/** Decrypt random data with the scalar and the SIMD/threaded code, check that they agree and print the throughput. **/
+static int benchmark(std::size_t mib) {
+	std::string key[4] = {"SingStar", "SCES-00000", "SCEE", "en"};
+	ChcDecode chc_decoder;
+	chc_decoder.load(key);
+	std::vector<char> data(mib << 20);
+	std::mt19937 rng(1);
+	for (auto& c: data) c = rng();
+	unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<char> reference = data;
+	std::vector<char> buf;
+	auto run = [&](char const* name, std::function<void ()> const& func) {
+		buf = data;
+		auto begin = std::chrono::steady_clock::now();
+		func();
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << name << ": " << mib / secs << " MiB/s" << std::endl;
+	};
+	run("Scalar", [&] { chc_decoder.decryptBlocksScalar(&buf[0], buf.size()); });
+	reference.swap(buf);
+	run("SIMD", [&] { chc_decoder.decryptBlocks(&buf[0], buf.size()); });
+	bool ok = buf == reference;
+	run(("SIMD, " + std::to_string(threads) + " threads").c_str(), [&] { chc_decoder.decryptBlocks(&buf[0], buf.size(), threads); });
+	ok = ok && buf == reference;
+	std::cout << (ok ? "Results are identical" : "Results differ!") << std::endl;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/** Write every melody of the decrypted file into outdir as ID.xml, inflating them in parallel. **/
+static void exportAll(ChcDecode const& chc_decoder, fs::path const& outdir) {
+	fs::create_directories(outdir);
+	std::vector<unsigned int> ids = chc_decoder.ids();
+	std::atomic<std::size_t> next(0);
+	std::mutex mutex;
+	std::string error;
+	auto worker = [&] {
+		for (std::size_t i; (i = next++) < ids.size(); ) {
+			try {
+				std::string xmlMelody = chc_decoder.getMelody(ids[i]);
+				fs::path file = outdir / (std::to_string(ids[i]) + ".xml");
+				std::ofstream f(file.string().c_str(), std::ios::binary);
+				f.write(xmlMelody.data(), xmlMelody.size());
+				if (!f) throw std::runtime_error("Could not write " + file.string());
+			} catch (std::exception& e) {
+				std::lock_guard<std::mutex> l(mutex);
+				if (error.empty()) error = std::to_string(ids[i]) + ": " + e.what();
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (unsigned int t = 1; t < std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), ids.size()); ++t) threads.emplace_back(worker);
+	worker();
+	for (auto& t: threads) t.join();
+	if (!error.empty()) throw std::runtime_error(error);
+	std::cout << "Wrote " << ids.size() << " melodies to " << outdir.string() << std::endl;
+}
+
 int main(int argc, char ** argv) {
-	if( argc != 7 ) {
+	if( argc >= 2 && argc <= 3 && std::strcmp(argv[1], "--benchmark") == 0 ) {
+		return benchmark(argc == 3 ? std::max(1, std::atoi(argv[2])) : 64);
+	}
+	bool all = argc == 9 && std::strcmp(argv[1], "--all") == 0 && std::strcmp(argv[2], "--outdir") == 0;
+	if( argc != 7 && !all ) {
 		std::cout << "Usage: " << argv[0] << " chc_file key0 key1 key2 key4 track_id" << std::endl;
+		std::cout << "       " << argv[0] << " --all --outdir DIR chc_file key0 key1 key2 key4" << std::endl;
+		std::cout << "       " << argv[0] << " --benchmark [MiB]" << std::endl;
 		return EXIT_FAILURE;
 	}
-	std::string key[4] = {argv[2], argv[3], argv[4], argv[5]};
+	char** args = all ? argv + 4 : argv + 1;
+	std::string key[4] = {args[1], args[2], args[3], args[4]};
 
 	std::ifstream chc_file;
-	chc_file.open(argv[1], std::ios_base::binary );
-
-	// Get the file size
-	chc_file.seekg(0, std::ios::end);
-	unsigned int fileSize = chc_file.tellg();
-	chc_file.seekg(0, std::ios::beg);
+	chc_file.open(args[0], std::ios_base::binary );
 
 	// Reading inputfile
-	char *buffer = new char[fileSize];
-	std::cout << "Reading input file \"" << argv[1] << "\" (" << fileSize << " Bytes)... " << std::endl;
-	chc_file.read(&buffer[0], fileSize);
+	std::vector<char> buffer((std::istreambuf_iterator<char>(chc_file)), std::istreambuf_iterator<char>());
+	std::cout << "Reading input file \"" << args[0] << "\" (" << buffer.size() << " Bytes)... " << std::endl;
 	chc_file.close();
 
-	ChcDecode chc_decoder;
-	chc_decoder.load(key);
-	std::string xmlMelody = chc_decoder.getMelody(buffer, fileSize, boost::lexical_cast<unsigned int>(argv[6]));
-
-	std::cout << xmlMelody << std::endl;
-
-	delete[] buffer;
+	try {
+		ChcDecode chc_decoder;
+		chc_decoder.load(key);
+		chc_decoder.decrypt(buffer, std::max(1u, std::thread::hardware_concurrency()));
+		if (all) {
+			exportAll(chc_decoder, argv[3]);
+		} else {
+			std::string xmlMelody = chc_decoder.getMelody(boost::lexical_cast<unsigned int>(args[5]));
+			std::cout << xmlMelody << std::endl;
+		}
+	} catch (std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,8 +18,13 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 
+#include "audio_encoder.hh"
 #include "chc_decode.hh"
+#include "job_runner.hh"
+#include "melody_txt.hh"
+#include "mpeg_ps.hh"
 #include "ss_cover.hh"
+#include "video_encoder.hh"
 
 #include "ss_helpers.hh"
 
@@ -23,111 +32,33 @@ namespace fs = boost::filesystem;
 
 struct Song {
 	std::string dataPakName, title, artist, genre, edition, year;
+	std::string melody;  ///< Melody XML (or the CHC file with all melodies) in pack_ee.pak
 	fs::path path, music, instrumental, vocals, video, background, cover;
 	unsigned samplerate;
-	double tempo;
+	double tempo, fps;
 	bool isDuet, pal;
         double medleyStart, medleyEnd;
-	Song(): samplerate(), tempo(), isDuet(), medleyStart(), medleyEnd() {}
+	Song(): samplerate(), tempo(), fps(), isDuet(), pal(), medleyStart(), medleyEnd() {}
 };
 
 #include "ss_binary.hh"
-
-enum Singer {
-	SINGER1,
-	SINGER2,
-	NUM_SINGERS
-};
+#include "ss_catalog.hh"
 
 std::string dvdPath;
-std::ofstream txtfile;
-std::string singerName[NUM_SINGERS];
-std::stringstream singerNotes[NUM_SINGERS];
-bool singerActive[NUM_SINGERS];
-int ts = 0;
-int sleepts = -1;
 bool g_video = true;
 bool g_audio = true;
 bool g_mkvcompress = true;
 bool g_mp4compress = true;
+bool g_mpegmux = false;
 bool g_oggcompress = true;
 bool g_mp3compress = true;
 bool g_createtxt = true;
 bool g_duet = true;
-
-void parseNote(xmlpp::Node* node) {
-	xmlpp::Element& elem = dynamic_cast<xmlpp::Element&>(*node);
-	std::stringstream notes;
-	char type = ':';
-	std::string lyric = elem.get_attribute("Lyric")->get_value();
-	// Some extra formatting to make lyrics look better (hyphen removal & whitespace)
-	if (lyric.size() > 0 && lyric[lyric.size() - 1] == '-') {
-		if (lyric.size() > 1 && lyric[lyric.size() - 2] == ' ') lyric.erase(lyric.size() - 2);
-		else lyric[lyric.size() - 1] = '~';
-	} else {
-		lyric += ' ';
-	}
-	unsigned note = boost::lexical_cast<unsigned>(elem.get_attribute("MidiNote")->get_value().c_str());
-	unsigned duration = boost::lexical_cast<unsigned>(elem.get_attribute("Duration")->get_value().c_str());
-        bool rap = elem.get_attribute("Rap");
-        bool golden = elem.get_attribute("Bonus");
-        bool freestyle = elem.get_attribute("FreeStyle");
-        if (!rap && golden) type = '*';
-        else if (rap && !golden) type = 'R';
-        else if (rap && golden) type = 'G';
-        else if (freestyle) type = 'F';
-	if (note) {
-		if (sleepts > 0) notes << "- " << sleepts << '\n';
-		sleepts = 0;
-		notes << type << ' ' << ts << ' ' << duration << ' ' << note << ' ' << lyric << '\n';
-	}
-	ts += duration;
-
-	bool written = false;
-	for (int i = 0; i < NUM_SINGERS; ++i) {
-		if (singerActive[i]) {
-			singerNotes[i] << notes.str();
-			written = true;
-		}
-	}
-	if (!written)
-		throw std::runtime_error("No singer for note");
-}
-
-void parseSentence(xmlpp::Node* node, bool withSinger) {
-	xmlpp::Element& elem = dynamic_cast<xmlpp::Element&>(*node);
-	if (withSinger) {
-		xmlpp::Attribute* singerAttr = elem.get_attribute("Singer");
-		if (singerAttr) {
-			std::string singerStr = singerAttr->get_value();
-			for (int i = 0; i < NUM_SINGERS; ++i)
-				singerActive[i] = false;
-			if (singerStr == "Solo 1") {
-				singerActive[SINGER1] = true;
-			} else if (singerStr == "Solo 2") {
-				singerActive[SINGER2] = true;
-			} else if (singerStr == "Group") {
-				singerActive[SINGER1] = true;
-				singerActive[SINGER2] = true;
-			} else throw std::runtime_error("Invalid Singer");
-		}
-	}
-	// FIXME: Get rid of this or use SSDom's find
-	xmlpp::Node::PrefixNsMap nsmap;
-	nsmap["ss"] = "http://www.singstargame.com";
-	auto n = elem.find("ss:NOTE", nsmap);
-	if (n.empty()) n = elem.find("NOTE");
-	if (sleepts != -1) sleepts = ts;
-	std::for_each(n.begin(), n.end(), parseNote);
-}
-
-void parseSentenceWithSinger(xmlpp::Node* node) {
-	parseSentence(node, true);
-}
-
-void parseSentenceWithoutSinger(xmlpp::Node* node) {
-	parseSentence(node, false);
-}
+bool g_seekindex = false;
+double g_videoStart = 0.0;
+double g_videoDuration = 0.0;
+unsigned g_videoGop = 1;
+unsigned g_cpus = 1;
 
 struct Match {
 	std::string left, right;
@@ -138,7 +69,7 @@ struct Match {
 	}
 };
 
-void initTxtFile(const fs::path &path, const Song &song, const std::string suffix = "") {
+void initTxtFile(std::ofstream& txtfile, const fs::path &path, const Song &song, const std::string suffix = "") {
 	fs::path file_path;
 	file_path = path / (std::string("notes") + suffix + ".txt");
 	txtfile.open(file_path.string().c_str());
@@ -164,18 +95,121 @@ void initTxtFile(const fs::path &path, const Song &song, const std::string suffi
 	}
 }
 
-void finalizeTxtFile() {
+void finalizeTxtFile(std::ofstream& txtfile) {
 	txtfile << 'E' << std::endl;
 	txtfile.close();
 }
 
+/** Create a track from decoded PCM: encode in-process if possible, otherwise queue an external encoder fed through a pipe. **/
+void encodeTrack(JobRunner& runner, JobRunner::Group const& group, fs::path& track, fs::path const& basename, std::vector<short> const& pcm, unsigned sr) {
+	fs::path wav = basename.string() + ".wav";
+	fs::path ogg = basename.string() + ".ogg";
+	fs::path mp3 = basename.string() + ".mp3";
+	if (g_oggcompress && encodeVorbis(ogg, pcm, sr)) { track = ogg; return; }
+	if (g_mp3compress && encodeMp3(mp3, pcm, sr)) { track = mp3; return; }
+	if (!g_oggcompress && !g_mp3compress) { writeMusic(wav, pcm, sr); track = wav; return; }
+	std::ostringstream oss;
+	writeMusic(oss, pcm, sr);
+	Job job;
+	job.input = std::make_shared<std::string>(oss.str());
+	fs::path out = g_oggcompress ? ogg : mp3;
+	if (g_oggcompress) job.argv = { "oggenc", "--quiet", "-", "-o", out.string() };
+	else job.argv = { "lame", "--quiet", "-q0", "-b256", "-", out.string() };
+	std::cerr << ">>> Compressing audio into " << filename(out) << std::endl;
+	std::shared_ptr<std::string const> input = job.input;
+	job.done = [&track, out, wav, input](bool ok) {
+		if (ok) { track = out; return; }
+		// Keep the audio as WAV if the encoder failed
+		std::cerr << "!!! Compressing " << out.string() << " failed, writing " << filename(wav) << " instead" << std::endl;
+		std::ofstream f(wav.string().c_str(), std::ios::binary);
+		f.write(input->data(), input->size());
+		track = wav;
+	};
+	runner.run(job, group);
+}
+
+/** Queue compression of video.mpg into the given file with ffmpeg. **/
+void encodeVideo(JobRunner& runner, JobRunner::Group const& group, Song& song, fs::path const& path, std::string const& name) {
+	std::cerr << ">>> Compressing video into " << name << std::endl;
+	Job job;
+	// Leave some of the budget to the other jobs and to our own decoding
+	job.cpus = std::max(1u, runner.cpus() / 2);
+	job.argv = { "ffmpeg", "-nostdin", "-loglevel", "error", "-i", (path / "video.mpg").string(), "-vcodec", "libx264", "-profile", "main", "-crf", "20",
+	  "-threads", std::to_string(job.cpus), "-metadata", "album=" + song.edition, "-metadata", "author=" + song.artist,
+	  "-metadata", "comment=" + song.genre, "-metadata", "title=" + song.title, (path / name).string() };
+	job.done = [&song, path, name](bool ok) {
+		if (!ok) return;
+		fs::remove(path / "video.mpg");
+		song.video = path / name;
+	};
+	runner.run(job, group);
+}
+
+/** Write an MPEG program stream of the produced video together with the song audio, interleaved picture by picture. **/
+void muxVideo(VideoProducer const& producer, fs::path const& file, bool pal, SongAudio const& audio, IPURange const& range) {
+	double fps = pal ? 25.0 : 30000.0 / 1001.0;
+	std::vector<short> const& pcm = audio.karaoke ? audio.mix : audio.pcm[0];
+	PSMux mux(file.string(), fps, audio.sr);
+	// Audio starts at the first converted frame
+	std::size_t begin = 2 * std::size_t(range.first / fps * audio.sr + 0.5);
+	std::size_t pos = std::min(begin, pcm.size());
+	producer([&](char const* data, std::size_t size) {
+		// Audio up to the end of the picture goes before it
+		std::size_t end = std::min(pcm.size(), begin + 2 * std::size_t((mux.videoTime() + 1.0 / fps) * audio.sr + 0.5));
+		if (end > pos) mux.audio(&pcm[pos], (end - pos) / 2);
+		pos = std::max(pos, end);
+		mux.video(data, size);
+	});
+	// Audio outlasting the video is kept unless only a part of the video was requested
+	if (!range.count && pos < pcm.size()) mux.audio(&pcm[pos], (pcm.size() - pos) / 2);
+	mux.finish();
+}
+
+/** Write the produced video in the format chosen on the command line: transcoded in-process if possible,
+* otherwise as video.mpg (with the audio muxed in for mpeg2), compressed later by ffmpeg for mkv and mp4.
+* If transcoding fails, the source is rewound to produce the video again for video.mpg.
+**/
+void writeVideo(JobRunner& runner, JobRunner::Group const& group, Song& song, fs::path const& path, bool pal, SongAudio const& audio, IPURange const& range, VideoProducer const& producer, std::function<void()> const& rewind) {
+	if (g_mkvcompress || g_mp4compress) {
+		std::string name = g_mkvcompress ? "video.mkv" : "video.mp4";
+		VideoMetadata metadata;
+		metadata.album = song.edition;
+		metadata.author = song.artist;
+		metadata.comment = song.genre;
+		metadata.title = song.title;
+		try {
+			if (transcodeVideo(path / name, producer, pal, metadata, runner.cpus())) {
+				song.video = path / name;
+				return;
+			}
+		} catch (TranscodeError& e) {
+			std::cerr << "!!! Transcoding into " << name << " failed (" << e.what() << "), using ffmpeg instead" << std::endl;
+			fs::remove(path / name);
+			rewind();
+		}
+	}
+	fs::path mpg = path / "video.mpg";
+	if (g_mpegmux && !audio.pcm[0].empty()) {
+		muxVideo(producer, mpg, pal, audio, range);
+	} else {
+		std::ofstream f(mpg.string().c_str(), std::ios::binary);
+		producer([&f](char const* data, std::size_t size) { f.write(data, size); });
+		if (!f) throw std::runtime_error("Writing " + mpg.string() + " failed");
+	}
+	song.video = mpg;
+	if (g_mkvcompress) encodeVideo(runner, group, song, path, "video.mkv");
+	if (g_mp4compress) encodeVideo(runner, group, song, path, "video.mp4");
+}
+
 ChcDecode chc_decoder;
 
 struct Process {
 	Pak const& pak;
-	Process(Pak const& p): pak(p) {}
+	JobRunner& runner;
+	Process(Pak const& p, JobRunner& r): pak(p), runner(r) {}
 	void operator()(std::pair<std::string const, Song>& songpair) {
 		fs::path remove;
+		JobRunner::Group group;
 		try {
 			std::string const& id = songpair.first;
 			Song& song = songpair.second;
@@ -184,15 +218,17 @@ struct Process {
 			SSDom dom;
 			{
 				std::vector<char> tmp;
-				Pak::files_t::const_iterator it = std::find_if(pak.files().begin(), pak.files().end(), Match("export/" + id + "/melody", ".xml"));
-				if (it == pak.files().end()) {
-					it = std::find_if(pak.files().begin(), pak.files().end(), Match("export/melodies_10", ".chc"));
-					if (it == pak.files().end()) throw std::runtime_error("Melody XML not found");
-					it->second.get(tmp);
-					dom.load(chc_decoder.getMelody(&tmp[0], tmp.size(), boost::lexical_cast<unsigned int>(id)));
+				if (song.melody.empty()) throw std::runtime_error("Melody XML not found");
+				if (fs::path(song.melody).extension() == ".chc") {
+					// The melodies of all songs are in one encrypted file, decrypted only for the first song
+					if (!chc_decoder.loaded()) {
+						pak[song.melody].get(tmp);
+						chc_decoder.decrypt(tmp, runner.cpus());
+					}
+					dom.load(chc_decoder.getMelody(boost::lexical_cast<unsigned int>(id)));
 				} else {
-					it->second.get(tmp);
-					dom.load(xmlFix(tmp));
+					pak[song.melody].get(tmp);
+					dom.loadFixed(tmp.data(), tmp.size());
 				}
 			}
 			if (song.tempo == 0.0) {
@@ -210,29 +246,58 @@ struct Process {
 			fs::create_directories(path);
 			remove = path;
 			dom.get_document()->write_to_file((path / "notes.xml").string(), "UTF-8");
+			// notes.txt is written after all encoders of the song have finished (and the media filenames are known)
+			auto txtFiles = std::make_shared<TxtFiles>();
+			if (g_createtxt) {
+				std::cerr << ">>> Extracting lyrics to notes.txt" << std::endl;
+				melodyToTxt(dom.get_document()->cobj(), song.isDuet, g_duet, *txtFiles);
+			}
+			auto complete = std::make_shared<bool>(false);
+			group = runner.group([&song, path, txtFiles, complete] {
+				if (!*complete) return;
+				for (auto const& txt: *txtFiles) {
+					std::ofstream txtfile;
+					initTxtFile(txtfile, path, song, txt.first);
+					txtfile << txt.second;
+					finalizeTxtFile(txtfile);
+				}
+			});
 			Pak dataPak(song.dataPakName);
+			SongAudio audio;  // Kept for muxing into the video
+			AdpcmIndex audioIndex;
+			// On US discs the audio is interleaved with the video and decoded while the video is read for conversion
+			std::unique_ptr<IavDemuxer> iav;
+			auto encodeAudio = [&] {
+				// The index is for music.mib, there is none for the audio interleaved in mus+vid.iav
+				if (g_seekindex && !audioIndex.empty()) {
+					std::ofstream f((path / "music.idx").string().c_str(), std::ios::binary);
+					audioIndex.write(f);
+				}
+				if (audio.karaoke) {
+					encodeTrack(runner, group, song.music, path / "music", audio.mix, audio.sr);
+					encodeTrack(runner, group, song.instrumental, path / "instrumental", audio.pcm[0], audio.sr);
+					encodeTrack(runner, group, song.vocals, path / "vocals", audio.pcm[1], audio.sr);
+				} else {
+					encodeTrack(runner, group, song.music, path / "music", audio.pcm[0], audio.sr);
+				}
+			};
 			if (g_audio) {
 				std::cerr << ">>> Extracting and decoding music" << std::endl;
 				try {
-					music(song, dataPak[id + "/music.mib"], pak["export/" + id + "/music.mih"], path);
+					music(audio, dataPak[id + "/music.mib"], pak["export/" + id + "/music.mih"], g_seekindex ? &audioIndex : NULL);
 				} catch (...) {
-					music_us(song, dataPak[id + "/mus+vid.iav"], dataPak[id + "/mus+vid.ind"], path);
-				}
-
-				// Is song music is empty but there is a instrumental track and a vocal track,
-				// merge both into a single track using sox
-				if (song.music.empty()) {
-					if (!song.instrumental.empty() && !song.vocals.empty()) {
-						std::cerr << ">>> Merging instrumental and vocal tracks" << std::endl;
-						std::string cmd = "sox -m \"" + song.instrumental.string() + "\" \"" + song.vocals.string() + "\" \"" + (path / "music.wav").string() + "\"";
-						std::cerr << cmd << std::endl;
-
-						if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-							song.music = path / "music.wav";
-						}
+					audioIndex = AdpcmIndex();
+					audio = SongAudio();
+					iav.reset(new IavDemuxer(dataPak[id + "/mus+vid.iav"], dataPak[id + "/mus+vid.ind"], &audio));
+					// Muxing into MPEG-2 needs the audio ahead of each picture, so then only the audio is demuxed first
+					if (!g_video || g_mpegmux) {
+						iav->demux();
+						iav.reset();
 					}
 				}
+				if (!iav) encodeAudio();
 			}
+			bool audioPending = iav != nullptr;
 
 			std::cerr << ">>> Extracting cover image" << std::endl;
 			try {
@@ -240,184 +305,55 @@ struct Process {
 				c.write(path / "/cover.png");
 				song.cover = path / "cover.png";
 			} catch (...) {}
-			remove = "";
-			// FIXME: use some library (preferrably ffmpeg):
-			if (g_oggcompress) {
-				if( !song.music.empty() ) {
-					std::cerr << ">>> Compressing audio into music.ogg" << std::endl;
-					std::string cmd = "oggenc \"" + song.music.string() + "\"";
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(song.music);
-						song.music = path / ("music.ogg");
-					}
-				}
-				if( !song.vocals.empty() ) {
-					std::cerr << ">>> Compressing audio into instrumental.ogg" << std::endl;
-					std::string cmd = "oggenc \"" + song.instrumental.string() + "\"";
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(song.instrumental);
-						song.instrumental = path / ("instrumental.ogg");
-					}
-				}
-				if( !song.vocals.empty() ) {
-					std::cerr << ">>> Compressing audio into vocals.ogg" << std::endl;
-					std::string cmd = "oggenc \"" + song.vocals.string() + "\"";
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(song.vocals);
-						song.vocals = path / ("vocals.ogg");
-					}
-				}
-			}
-			if (g_mp3compress) {
-				if( !song.music.empty() ) {
-					std::cerr << ">>> Compressing audio into music.mp3" << std::endl;
-					std::string cmd = "lame -q0 -b256 \"" + song.music.string() + "\"";
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(song.music);
-						song.music = path / ("music.mp3");
-					}
-				}
-				if( !song.instrumental.empty() ) {
-					std::cerr << ">>> Compressing audio into instrumental.mp3" << std::endl;
-					std::string cmd = "lame -q0 -b256 \"" + song.instrumental.string() + "\"";
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(song.instrumental);
-						song.instrumental = path / ("instrumental.mp3");
-					}
-				}
-				if( !song.vocals.empty() ) {
-					std::cerr << ">>> Compressing audio into vocals.mp3" << std::endl;
-					std::string cmd = "lame -q0 -b256 \"" + song.vocals.string() + "\"";
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(song.vocals);
-						song.vocals = path / ("vocals.mp3");
-					}
-				}
-			}
 			if (g_video) {
 				std::cerr << ">>> Extracting video" << std::endl;
 				try {
-					std::vector<char> ipudata;
-					dataPak[id + "/movie.ipu"].get(ipudata);
+					PakReader ipu(dataPak[id + "/movie.ipu"]);
+					IPUSource source = [&ipu](char* buf, std::size_t size) -> std::size_t { return ipu.read(buf, size); };
+					IPURange range = IPURange::time(g_videoStart, g_videoDuration);
+					IPUIndex index;
+					if (g_seekindex) {
+						index.build(source);
+						std::ofstream f((path / "video.idx").string().c_str(), std::ios::binary);
+						index.write(f);
+						ipu.seek(0);
+						range.index = &index;
+						range.seek = [&ipu](std::size_t pos) { ipu.seek(pos); };
+					}
 					std::cerr << ">>> Converting video" << std::endl;
-					IPUConv(ipudata, (path / "video.mpg").string());
-					song.video = path / "video.mpg";
+					writeVideo(runner, group, song, path, true, audio, range, [&](IPUSink const& sink) {
+						IPUConv(source, sink, true, runner.cpus(), range, g_videoGop);
+					}, [&ipu] { ipu.seek(0); });
 				} catch (...) {
 					std::cerr << "  >>> European DVD failed, trying American (WIP)" << std::endl;
 					try {
-						video_us(song, dataPak[id + "/mus+vid.iav"], dataPak[id + "/mus+vid.ind"], path);
+						IPURange range = IPURange::time(g_videoStart, g_videoDuration, song.pal);
+						if (!iav) iav.reset(new IavDemuxer(dataPak[id + "/mus+vid.iav"], dataPak[id + "/mus+vid.ind"]));
+						writeVideo(runner, group, song, path, song.pal, audio, range, [&](IPUSink const& sink) {
+							IPUConv(std::ref(*iav), sink, song.pal, runner.cpus(), range, g_videoGop);
+						}, [&] {
+							// The audio is decoded to the end before starting over with a demuxer for the video only
+							iav->demux();
+							iav.reset(new IavDemuxer(dataPak[id + "/mus+vid.iav"], dataPak[id + "/mus+vid.ind"]));
+						});
 					} catch (std::exception& e) {
 						std::cerr << "!!! Unable to extract video: " << e.what() << std::endl;
 						song.video = "";
 					}
 				}
-				if (g_mkvcompress) {
-					std::cerr << ">>> Compressing video into video.m4v" << std::endl;
-					std::string cmd = "ffmpeg -i \"" + (path / "video.mpg").string() + "\" -vcodec libx264 -profile main -crf 20 -threads 0 -metadata album=\"" + song.edition + "\" -metadata author=\"" + song.artist + "\" -metadata comment=\"" + song.genre + "\" -metadata title=\"" + song.title + "\" \"" + (path / "video.m4v\"").string();
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(path / "video.mpg");
-						song.video = path / "video.m4v";
-					}
-				}
-				if (g_mp4compress) {
-					std::cerr << ">>> Compressing video into video.mp4" << std::endl;
-					std::string cmd = "ffmpeg -i \"" + (path / "video.mpg").string() + "\" -vcodec libx264 -profile main -crf 20 -threads 0 -metadata album=\"" + song.edition + "\" -metadata author=\"" + song.artist + "\" -metadata comment=\"" + song.genre + "\" -metadata title=\"" + song.title + "\" \"" + (path / "video.mp4\"").string();
-					std::cerr << cmd << std::endl;
-					if (std::system(cmd.c_str()) == 0) { // FIXME: std::system return value is not portable
-						fs::remove(path / "video.mpg");
-						song.video = path / "video.mp4";
-					}
-				}
 			}
-
-			if (g_createtxt) {
-				std::cerr << ">>> Extracting lyrics to notes.txt" << std::endl;
-				xmlpp::const_NodeSet sentences;
-
-				if (song.isDuet) {
-					xmlpp::const_NodeSet tracks;
-					if (!dom.find("/ss:MELODY/ss:TRACK", tracks)) throw std::runtime_error("Unable to find any tracks in melody XML");
-
-					if (tracks.size() != NUM_SINGERS)
-						throw std::runtime_error("Invalid number of tracks");
-
-					xmlpp::Element *trackElem[NUM_SINGERS];
-
-					auto it = tracks.begin();
-					for (int i = 0; i < NUM_SINGERS; ++i) {
-						trackElem[i] = dynamic_cast<xmlpp::Element*>(*it++);
-						xmlpp::Attribute *artistAttr = trackElem[i]->get_attribute("Artist");
-						if (!artistAttr) {
-							artistAttr = trackElem[i]->get_attribute("Name");
-							if (!artistAttr)
-								throw std::runtime_error("Track without Artist");
-						}
-						singerName[i] = artistAttr->get_value();
-						singerActive[i] = false;
-					}
-
-					if(dom.find("/ss:MELODY/ss:SENTENCE", sentences)) {
-						std::cerr << "  >>> Single-track duet" << std::endl;
-
-						ts = 0;
-						sleepts = -1;
-						std::for_each(sentences.begin(), sentences.end(), parseSentenceWithSinger);
-					} else {
-						std::cerr << "  >>> Double-track duet" << std::endl;
-
-						for (int i = 0; i < NUM_SINGERS; ++i) {
-							if (!dom.find(*trackElem[i], "ss:SENTENCE", sentences))
-								throw std::runtime_error("Unable to find any sentectes inside track in melody XML");
-							ts = 0;
-							sleepts = -1;
-							singerActive[i] = true;
-							std::for_each(sentences.begin(), sentences.end(), parseSentenceWithoutSinger);
-							singerActive[i] = false;
-						}
-					}
-					if (g_duet) {
-						initTxtFile(path, song);
-						for (int i = 0; i < NUM_SINGERS; ++i) {
-							txtfile << "#P" << i+1 << ": " << singerName[i] << "\n";
-						}
-						for (int i = 0; i < NUM_SINGERS; ++i) {
-							txtfile << "P" << i + 1 << "\n";
-							txtfile << singerNotes[i].rdbuf();
-						}
-						finalizeTxtFile();
-					} else {
-						for (int i = 0; i < NUM_SINGERS; ++i) {
-							initTxtFile(path, song, " (" + singerName[i] + ")");
-							txtfile << singerNotes[i].rdbuf();
-							finalizeTxtFile();
-						}
-					}
-				} else {
-					std::cerr << "  >>> Solo track" << std::endl;
-
-					if(!dom.find("/ss:MELODY/ss:SENTENCE", sentences)) throw std::runtime_error("Unable to find any sentences in melody XML");
-
-					ts = 0;
-					sleepts = -1;
-					for (int i = 0; i < NUM_SINGERS; ++i)
-						singerActive[i] = false;
-					singerActive[SINGER1] = true;
-					std::for_each(sentences.begin(), sentences.end(), parseSentenceWithoutSinger);
-					initTxtFile(path, song);
-					txtfile << singerNotes[SINGER1].rdbuf();
-					finalizeTxtFile();
-				}
+			if (audioPending) {
+				// The audio past the converted part of the video (all of it if the conversion failed)
+				iav->demux();
+				encodeAudio();
 			}
+			remove = "";
+			*complete = true;
 		} catch (std::exception& e) {
 			std::cerr << e.what() << std::endl;
 			if (!remove.empty()) {
+				// The encoders of the song write into the directory
+				if (group.use_count()) runner.cancel(group);
 				std::cerr << "!!! Removing " << remove.string() << std::endl;
 				fs::remove_all(remove);
 			}
@@ -425,93 +361,97 @@ struct Process {
 	}
 };
 
-void get_node(const xmlpp::Node* node, std::string& genre, std::string& year)
-{
-	const xmlpp::ContentNode* nodeContent = dynamic_cast<const xmlpp::ContentNode*>(node);
-	const xmlpp::TextNode* nodeText = dynamic_cast<const xmlpp::TextNode*>(node);
-	const xmlpp::CommentNode* nodeComment = dynamic_cast<const xmlpp::CommentNode*>(node);
-
-	if(nodeText && nodeText->is_white_space()) //Let's ignore the indenting - you don't always want to do this.
-		return;
-
-	//Treat the various node types differently:
-	if(nodeText || nodeComment || nodeContent)
-	{
-		// if any of these exist do nothing! :D
+/** Find GENRE and YEAR attributes anywhere within the element (the last ones in document order win). **/
+void findGenreYear(xmlNode const* node, std::string& genre, std::string& year) {
+	for (xmlAttr const* attr = node->properties; attr; attr = attr->next) {
+		std::string* result = xmlStrEqual(attr->name, BAD_CAST "GENRE") ? &genre : xmlStrEqual(attr->name, BAD_CAST "YEAR") ? &year : NULL;
+		if (!result) continue;
+		xmlChar* value = xmlNodeListGetString(node->doc, attr->children, 1);
+		*result = normalize(value ? reinterpret_cast<char const*>(value) : "");
+		xmlFree(value);
 	}
-	else if(const xmlpp::Element* nodeElement = dynamic_cast<const xmlpp::Element*>(node))
-	{
-		//A normal Element node:
-
-		//Print attributes:
-		auto attributes = nodeElement->get_attributes();
-		for(auto iter = attributes.begin(); iter != attributes.end(); ++iter)
-		{
-			const xmlpp::Attribute* attribute = *iter;
-			if (attribute->get_name() == "GENRE") genre = normalize(attribute->get_value());
-			else if (attribute->get_name() == "YEAR") year = normalize(attribute->get_value());
-		}
-	}
-
-	if(!nodeContent)
-	{
-		//Recurse through child nodes:
-		auto list = node->get_children();
-		for(auto iter = list.begin(); iter != list.end(); ++iter)
-		{
-			get_node(*iter, genre, year); //recursive
-		}
+	for (xmlNode const* child = node->children; child; child = child->next) {
+		if (child->type == XML_ELEMENT_NODE) findGenreYear(child, genre, year);
 	}
 }
 
+/** Find the songs on a disc: config.xml is read first (for the edition and the keys), then
+* the song set XMLs are parsed in parallel and merged in archive order.
+**/
 struct FindSongs {
-	std::string edition;
-	std::string language;
-	std::map<std::string, Song> songs;
-	FindSongs(std::string const& search = ""): m_search(search) {}
-	void operator()(Pak::files_t::value_type const& p) {
-		std::string name = p.first;
-		if (name.substr(0, 17) == "export/config.xml"){
-			SSDom dom(p.second);  // Read config XML
-			// Load decryption keys required for some SingStar games (since 2009 or so)
-			std::string keys[4];
-			dom.getValue("/ss:CONFIG/ss:PRODUCT_NAME", keys[0]);
-			dom.getValue("/ss:CONFIG/ss:PRODUCT_CODE", keys[1]);
-			dom.getValue("/ss:CONFIG/ss:TERRITORY", keys[2]);
-			dom.getValue("/ss:CONFIG/ss:DEFAULT_LANG", keys[3]);
-			chc_decoder.load(keys);
-			// Get the singstar edition, use PRODUCT_NAME as fallback for SS Original and SS Party
-			if (!dom.getValue("/ss:CONFIG/ss:PRODUCT_DESC", edition)) edition = keys[0];
-			if (edition.empty()) throw std::runtime_error("No PRODUCT_DESC or PRODUCT_NAME found");
-			edition = prettyEdition(edition);
-			std::cout << "### " << edition << std::endl;
-			// Get language if available
-			language = keys[3];
+	Catalog& catalog;
+	FindSongs(Pak const& pak, Catalog& c, unsigned threads): catalog(c) {
+		// Index pass: pick the files of interest without reading anything
+		std::vector<Pak::files_t::value_type const*> songSets;
+		for (auto const& p: pak.files()) {
+			std::string const& name = p.first;
+			if (name.substr(0, 17) == "export/config.xml") config(p.second);
+			else if (name.substr(0, 12) == "export/songs" && name.size() >= 16 && name.substr(name.size() - 4) == ".xml") songSets.push_back(&p);
 		}
-
-		if (name.substr(0, 12) != "export/songs" || name.substr(name.size() - 4) != ".xml") return;
-		SSDom dom(p.second);  // Read song XML
-
-
+		std::vector<std::map<std::string, Song> > found(songSets.size());
+		std::vector<std::exception_ptr> errors(songSets.size());
+		xmlInitParser();  // Must be done before libxml is used from several threads
+		std::atomic<std::size_t> next(0);
+		auto worker = [&] {
+			for (std::size_t i; (i = next++) < songSets.size(); ) {
+				try { songSet(songSets[i]->first, songSets[i]->second, found[i]); }
+				catch (...) { errors[i] = std::current_exception(); }
+			}
+		};
+		std::vector<std::thread> workers;
+		for (std::size_t t = 1; t < std::min<std::size_t>(std::max(1u, threads), songSets.size()); ++t) workers.emplace_back(worker);
+		worker();
+		for (auto& w: workers) w.join();
+		// Later files replace songs with the same ID, as when reading them one by one
+		for (std::size_t i = 0; i < found.size(); ++i) {
+			if (errors[i]) std::rethrow_exception(errors[i]);
+			for (auto& song: found[i]) catalog.songs[song.first] = std::move(song.second);
+		}
+		// Locate the melodies, either one XML per song or all of them in one encrypted file
+		auto chc = std::find_if(pak.files().begin(), pak.files().end(), Match("export/melodies_10", ".chc"));
+		for (auto& song: catalog.songs) {
+			auto it = std::find_if(pak.files().begin(), pak.files().end(), Match("export/" + song.first + "/melody", ".xml"));
+			if (it == pak.files().end()) it = chc;
+			if (it != pak.files().end()) song.second.melody = it->first;
+		}
+	}
+  private:
+	void config(PakFile const& file) {
+		SSDom dom(file);  // Read config XML
+		// Load decryption keys required for some SingStar games (since 2009 or so)
+		std::string* keys = catalog.keys;
+		dom.getValue("/ss:CONFIG/ss:PRODUCT_NAME", keys[0]);
+		dom.getValue("/ss:CONFIG/ss:PRODUCT_CODE", keys[1]);
+		dom.getValue("/ss:CONFIG/ss:TERRITORY", keys[2]);
+		dom.getValue("/ss:CONFIG/ss:DEFAULT_LANG", keys[3]);
+		catalog.productCode = keys[1];
+		// Get the singstar edition, use PRODUCT_NAME as fallback for SS Original and SS Party
+		if (!dom.getValue("/ss:CONFIG/ss:PRODUCT_DESC", catalog.edition)) catalog.edition = keys[0];
+		if (catalog.edition.empty()) throw std::runtime_error("No PRODUCT_DESC or PRODUCT_NAME found");
+		catalog.edition = prettyEdition(catalog.edition);
+		// Get language if available
+		catalog.language = keys[3];
+	}
+	/// Read the songs of one song set XML (run in parallel, so only touches songs)
+	void songSet(std::string const& name, PakFile const& file, std::map<std::string, Song>& songs) const {
+		SSDom dom(file);  // Read song XML
 		xmlpp::const_NodeSet n;
 		dom.find("/ss:SONG_SET/ss:SONG", n);
 		Song s;
 		s.dataPakName = dvdPath + "/pak_iop" + name[name.size() - 5] + ".pak";
-		s.edition = edition;
+		s.edition = catalog.edition;
 		for (auto it = n.begin(), end = n.end(); it != end; ++it) {
 			// Extract song info
 			xmlpp::Element& elem = dynamic_cast<xmlpp::Element&>(**it);
 			s.title = elem.get_attribute("TITLE")->get_value();
 			s.artist = elem.get_attribute("PERFORMANCE_NAME")->get_value();
-			if (!m_search.empty() && m_search != elem.get_attribute("ID")->get_value() && (s.artist + " - " + s.title).find(m_search) == std::string::npos) continue;
-			xmlpp::Node const* node = dynamic_cast<xmlpp::Node const*>(*it);
-			get_node(node, s.genre, s.year); // get the values for genre and year
+			findGenreYear(elem.cobj(), s.genre, s.year);
 			// Get video FPS
-			double fps = 25.0;
+			s.fps = 25.0;
 			xmlpp::const_NodeSet fr;
 			if (dom.find(elem, "ss:VIDEO/@FRAME_RATE", fr))
-			  fps = boost::lexical_cast<double>(dynamic_cast<xmlpp::Attribute&>(*fr[0]).get_value().c_str());
-			if (fps == 25.0) s.pal = true;
+			  s.fps = boost::lexical_cast<double>(dynamic_cast<xmlpp::Attribute&>(*fr[0]).get_value().c_str());
+			if (s.fps == 25.0) s.pal = true;
 			const xmlpp::Node::NodeList medleys = elem.get_children("MEDLEYS");
 			if (medleys.size() > 0) {
 				for (auto const &mt : medleys.front()->get_children("TYPE")) {
@@ -526,12 +466,40 @@ struct FindSongs {
 			songs[elem.get_attribute("ID")->get_value()] = s;
 		}
 	}
-  private:
-	std::string m_search;
 };
 
+/** Get the catalog of the disc from the cache directory (if not empty) or by reading its XML files (updating the cache). **/
+void loadCatalog(Pak const& pak, Catalog& catalog, fs::path const& cacheDir) {
+	std::string stamp;
+	fs::path cache;
+	if (!cacheDir.empty()) {
+		stamp = Catalog::stamp(dvdPath);
+		cache = Catalog::file(cacheDir, stamp);
+		std::ifstream f(cache.string().c_str(), std::ios::binary);
+		if (f && catalog.read(f, stamp, dvdPath)) {
+			std::cerr << ">>> Using cached song catalog " << cache.string() << std::endl;
+			return;
+		}
+	}
+	FindSongs(pak, catalog, g_cpus);
+	if (cache.empty()) return;
+	// The cache is only an optimization, so failing to write it is not an error
+	boost::system::error_code ec;
+	fs::create_directories(cacheDir, ec);
+	fs::path tmp = cache.string() + ".tmp";
+	{
+		std::ofstream f(tmp.string().c_str(), std::ios::binary);
+		catalog.write(f, stamp);
+		if (!f) return;
+	}
+	fs::rename(tmp, cache, ec);
+}
+
 int main( int argc, char **argv) {
-	std::string video, audio, song;
+	std::string video, audio, song, cacheDir;
+	// Catalog caches go to the user's cache directory by default
+	if (char const* xdg = std::getenv("XDG_CACHE_HOME")) cacheDir = std::string(xdg) + "/ss_extract";
+	else if (char const* home = std::getenv("HOME")) cacheDir = std::string(home) + "/.cache/ss_extract";
 	namespace po = boost::program_options;
 	po::options_description opt("Options");
 	opt.add_options()
@@ -539,10 +507,16 @@ int main( int argc, char **argv) {
 	  ("dvd", po::value<std::string>(&dvdPath), "path to Singstar DVD root")
 	  ("list,l", "list tracks only")
 	  ("song", po::value<std::string>(&song), "only extract the given track (ID or partial name)")
-	  ("video", po::value<std::string>(&video)->default_value("mkv"), "specify video format (none, mkv, mp4, mpeg2)")
+	  ("video", po::value<std::string>(&video)->default_value("mkv"), "specify video format (none, mkv, mp4, mpeg2 (with the audio muxed in))")
 	  ("audio", po::value<std::string>(&audio)->default_value("ogg"), "specify audio format (none, ogg, mp3, wav)")
 	  ("txt,t", "also convert XML to notes.txt (for UltraStar compatibility)")
 	  ("duet,d", "create single duet-mode txt file for duets")
+	  ("seek-index", "also write music.idx and video.idx, seek indexes for the original audio and video streams (music.mib and movie.ipu, not on US discs)")
+	  ("start", po::value<double>(&g_videoStart)->default_value(0.0), "only convert the video from this time on (seconds), e.g. for previews")
+	  ("duration", po::value<double>(&g_videoDuration)->default_value(0.0), "only convert this many seconds of video (0 for all)")
+	  ("gop", po::value<unsigned>(&g_videoGop)->default_value(1), "frames per GOP in the converted MPEG video (longer GOPs make smaller files)")
+	  ("cache", po::value<std::string>(&cacheDir)->default_value(cacheDir), "directory for caching song catalogs of discs (empty to disable)")
+	  ("jobs,j", po::value<unsigned>(&g_cpus)->default_value(std::max(1u, std::thread::hardware_concurrency())), "number of CPUs used by external encoders running in background")
 	  ;
 	// Process the first flagless option as dvd, the second as song
 	po::positional_options_description pos;
@@ -573,6 +547,7 @@ int main( int argc, char **argv) {
 			g_video = true;
 			g_mkvcompress = false;
 			g_mp4compress = false;
+			g_mpegmux = true;
 		} else {
 			throw std::runtime_error("Invalid video flag. Value must be {none, mkv, mp4, mpeg2}");
 		}
@@ -600,6 +575,7 @@ int main( int argc, char **argv) {
 		std::cerr << ">>> Using audio flag: \"" << audio << "\"" << std::endl;
 		g_createtxt = vm.count("txt") > 0 || vm.count("duet") > 0;
 		g_duet = vm.count("duet") > 0;
+		g_seekindex = vm.count("seek-index") > 0;
 		std::cerr << ">>> Convert XML to notes.txt: " << (g_createtxt?"yes":"no") << std::endl;
 		std::cerr << ">>> Create single duet-mode txt file for duets: " << (g_duet?"yes":"no") << std::endl;
 	} catch (std::exception& e) {
@@ -619,13 +595,27 @@ int main( int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 	Pak p(pack_ee);
-	FindSongs f = std::for_each(p.files().begin(), p.files().end(), FindSongs(song));
-	std::cerr << f.songs.size() << " songs found" << std::endl;
+	Catalog catalog;
+	loadCatalog(p, catalog, cacheDir);
+	chc_decoder.load(catalog.keys);
+	std::cout << "### " << catalog.edition << std::endl;
+	std::map<std::string, Song>& songs = catalog.songs;
+	if (!song.empty()) {
+		for (auto it = songs.begin(); it != songs.end(); ) {
+			if (song != it->first && (it->second.artist + " - " + it->second.title).find(song) == std::string::npos) it = songs.erase(it);
+			else ++it;
+		}
+	}
+	std::cerr << songs.size() << " songs found" << std::endl;
 	if (vm.count("list")) {
-		for( std::map<std::string, Song>::const_iterator it = f.songs.begin() ; it != f.songs.end();  ++it) {
+		for( std::map<std::string, Song>::const_iterator it = songs.begin() ; it != songs.end();  ++it) {
 			std::cout << "[" << it->first << "] " << it->second.artist << " - " << it->second.title << std::endl;
 		}
 	}
-	else std::for_each(f.songs.begin(), f.songs.end(), Process(p));
+	else {
+		JobRunner runner(g_cpus);
+		std::for_each(songs.begin(), songs.end(), Process(p, runner));
+		runner.wait();
+	}
 }
 
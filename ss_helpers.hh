@@ -3,6 +3,7 @@
 #include <boost/algorithm/string.hpp>
 #include <libxml++/libxml++.h>
 #include <glibmm/convert.h>
+#include <cstring>
 #include "pak.h"
 #include "config.hh"
 
@@ -33,13 +34,50 @@ namespace xmlpp {
 #endif
 }
 
-/** Fix Singstar's b0rked XML **/
-std::string xmlFix(std::vector<char> const& data) {
-	std::string ret;
-	for(std::size_t i = 0; i < data.size(); ++i) {
-		if (data[i] != '&') ret += data[i]; else ret += "&amp;";
+/** Fix Singstar's b0rked XML (escape every '&') into out. Returns false, leaving out alone, if there was nothing to fix. **/
+bool xmlFix(char const* data, std::size_t size, std::string& out) {
+	char const* end = data + size;
+	std::size_t count = 0;
+	for (char const* p = data; (p = static_cast<char const*>(std::memchr(p, '&', end - p))); ++p) ++count;
+	if (!count) return false;
+	out.clear();
+	out.reserve(size + 4 * count);
+	for (char const* p = data; p != end; ) {
+		char const* amp = static_cast<char const*>(std::memchr(p, '&', end - p));
+		if (!amp) amp = end;
+		out.append(p, amp);
+		if (amp == end) break;
+		out += "&amp;";
+		p = amp + 1;
 	}
-	return ret;
+	return true;
+}
+
+/** Is the XML UTF-8 encoded (or in an encoding that libxml can tell by itself)? SingStar files are either UTF-8 or
+* undeclared ISO-8859-1, which is only recognized by the data not being valid UTF-8.
+**/
+bool xmlIsUTF8(char const* data, std::size_t size) {
+	unsigned char const* p = reinterpret_cast<unsigned char const*>(data);
+	unsigned char const* end = p + size;
+	if (size >= 2 && ((p[0] == 0xFE && p[1] == 0xFF) || (p[0] == 0xFF && p[1] == 0xFE))) return true;  // UTF-16 BOM
+	// An explicitly declared encoding is handled by libxml
+	if (size >= 5 && std::memcmp(p, "<?xml", 5) == 0) {
+		unsigned char const* close = static_cast<unsigned char const*>(std::memchr(p, '>', size));
+		std::string decl(p, close ? close : end);
+		std::size_t pos = decl.find("encoding=");
+		if (pos != std::string::npos && pos + 10 < decl.size()) {
+			std::string enc = decl.substr(pos + 10, decl.find(decl[pos + 9], pos + 10) - (pos + 10));
+			if (!boost::iequals(enc, "UTF-8") && !boost::iequals(enc, "UTF8")) return true;
+		}
+	}
+	while (p < end) {
+		if (*p < 0x80) { ++p; continue; }
+		unsigned n = *p >= 0xF0 ? 3 : *p >= 0xE0 ? 2 : *p >= 0xC2 ? 1 : 0;
+		if (!n || *p > 0xF4 || std::size_t(end - p) <= n) return false;
+		for (unsigned i = 1; i <= n; ++i) if ((p[i] & 0xC0) != 0x80) return false;
+		p += n + 1;
+	}
+	return true;
 }
 
 struct SSDom: public xmlpp::DomParser {
@@ -47,21 +85,30 @@ struct SSDom: public xmlpp::DomParser {
 	SSDom(PakFile const& file) {
 		std::vector<char> tmp;
 		file.get(tmp);
-		std::string buf = xmlFix(tmp);
-		load(buf);
+		loadFixed(tmp.data(), tmp.size());
 	}
 	SSDom() {}
-	void load(std::string const& buf) {
+	void load(std::string const& buf) { load(buf.data(), buf.size()); }
+	/// Load SingStar XML that may have unescaped '&' characters
+	void loadFixed(char const* data, std::size_t size) {
+		std::string fixed;
+		if (xmlFix(data, size, fixed)) load(fixed.data(), fixed.size()); else load(data, size);
+	}
+	/// Parse straight from memory, converting the data to UTF-8 first only if it is in ISO-8859-1
+	void load(char const* data, std::size_t size) {
 		set_substitute_entities();
-		try {
+		std::string converted;
+		if (!xmlIsUTF8(data, size)) {
+			converted = Glib::convert(std::string(data, size), "UTF-8", "ISO-8859-1");
+			data = converted.data();
+			size = converted.size();
+		}
+		{
 			struct DisableLogger {
 				DisableLogger() { disableXMLLogger(); }
 				~DisableLogger() { enableXMLLogger(); }
 			} disabler;
-			parse_memory(buf);
-		} catch (...) {
-			std::string buf2 = Glib::convert(buf, "UTF-8", "ISO-8859-1"); // Convert to UTF-8
-			parse_memory(buf2);
+			parse_memory_raw(reinterpret_cast<unsigned char const*>(data), size);
 		}
 		nsmap["ss"] = get_document()->get_root_node()->get_namespace_uri();
 	}
@@ -0,0 +1,142 @@
+#include "video_encoder.hh"
+#include "config.hh"
+
+#include <algorithm>
+
+#ifdef HAVE_LIBAV
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+	void check(int err, char const* what) {
+		if (err >= 0) return;
+		char buf[AV_ERROR_MAX_STRING_SIZE] = {};
+		av_strerror(err, buf, sizeof(buf));
+		throw TranscodeError(std::string(what) + ": " + buf);
+	}
+
+	/** Decodes MPEG-2 pictures and encodes them into H.264, writing the container as packets come out. **/
+	struct Transcoder {
+		AVFormatContext* format;
+		AVCodecContext* decoder;
+		AVCodecContext* encoder;
+		AVStream* stream;
+		AVFrame* frame;
+		AVPacket* packet;
+		AVRational frameRate;
+		unsigned threads;
+		int64_t pictures;  // Pictures passed to the decoder so far
+		bool opened;  // Encoder opened and header written
+		Transcoder(unsigned threads):
+		  format(), decoder(), encoder(), stream(), frame(av_frame_alloc()), packet(av_packet_alloc()), frameRate(), threads(threads), pictures(), opened() {}
+		~Transcoder() {
+			avcodec_free_context(&encoder);
+			avcodec_free_context(&decoder);
+			av_packet_free(&packet);
+			av_frame_free(&frame);
+			if (format) {
+				avio_closep(&format->pb);
+				avformat_free_context(format);
+			}
+		}
+		/// Set up the encoder options and the decoder, then create the file
+		void open(fs::path const& filename, bool pal, VideoMetadata const& metadata) {
+			frameRate = pal ? AVRational{ 25, 1 } : AVRational{ 30000, 1001 };
+			if (!frame || !packet) throw TranscodeError("Out of memory");
+			// Whatever the encoder does not support is found out here, before any of the video is produced
+			AVCodec const* codec = avcodec_find_encoder_by_name("libx264");
+			if (!codec) codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+			if (!codec) throw TranscodeError("No H.264 encoder in libavcodec");
+			encoder = avcodec_alloc_context3(codec);
+			if (!encoder) throw TranscodeError("Out of memory");
+			if (!encoder->priv_data) throw TranscodeError(std::string("H.264 encoder ") + codec->name + " has no profile or crf option");
+			check(av_opt_set(encoder->priv_data, "profile", "main", 0), "H.264 encoder does not support profile main");
+			check(av_opt_set(encoder->priv_data, "crf", "20", 0), "H.264 encoder does not support crf");
+			codec = avcodec_find_decoder(AV_CODEC_ID_MPEG2VIDEO);
+			if (!codec) throw TranscodeError("No MPEG-2 decoder in libavcodec");
+			decoder = avcodec_alloc_context3(codec);
+			if (!decoder) throw TranscodeError("Out of memory");
+			decoder->thread_count = threads;
+			check(avcodec_open2(decoder, codec, NULL), "Cannot open the MPEG-2 decoder");
+			check(avformat_alloc_output_context2(&format, NULL, NULL, filename.string().c_str()), "Cannot determine the container");
+			av_dict_set(&format->metadata, "album", metadata.album.c_str(), 0);
+			av_dict_set(&format->metadata, "author", metadata.author.c_str(), 0);
+			av_dict_set(&format->metadata, "comment", metadata.comment.c_str(), 0);
+			av_dict_set(&format->metadata, "title", metadata.title.c_str(), 0);
+			check(avio_open(&format->pb, filename.string().c_str(), AVIO_FLAG_WRITE), "Cannot create the video file");
+		}
+		/// Open the encoder and the stream once the picture size is known from the first decoded frame
+		void openEncoder() {
+			encoder->width = frame->width;
+			encoder->height = frame->height;
+			encoder->sample_aspect_ratio = frame->sample_aspect_ratio;
+			encoder->pix_fmt = static_cast<AVPixelFormat>(frame->format);
+			encoder->time_base = av_inv_q(frameRate);
+			encoder->framerate = frameRate;
+			encoder->thread_count = threads;
+			if (format->oformat->flags & AVFMT_GLOBALHEADER) encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+			check(avcodec_open2(encoder, encoder->codec, NULL), "Cannot open the H.264 encoder");
+			stream = avformat_new_stream(format, NULL);
+			if (!stream) throw TranscodeError("Out of memory");
+			stream->time_base = encoder->time_base;
+			stream->avg_frame_rate = frameRate;
+			check(avcodec_parameters_from_context(stream->codecpar, encoder), "Cannot set up the video stream");
+			check(avformat_write_header(format, NULL), "Cannot write the video file header");
+			opened = true;
+		}
+		/// Pass a frame (NULL to flush) to the encoder and write whatever packets it has ready
+		void encode(AVFrame* f) {
+			check(avcodec_send_frame(encoder, f), "H.264 encoding failed");
+			while (true) {
+				int err = avcodec_receive_packet(encoder, packet);
+				if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) return;
+				check(err, "H.264 encoding failed");
+				av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+				packet->stream_index = stream->index;
+				check(av_interleaved_write_frame(format, packet), "Writing the video failed");
+			}
+		}
+		/// Pass a picture (NULL to flush) to the decoder and encode the frames it has ready
+		void decode(char const* data, std::size_t size) {
+			if (data) {
+				check(av_new_packet(packet, size), "Out of memory");
+				std::copy(data, data + size, packet->data);
+				packet->pts = packet->dts = pictures++;
+				int err = avcodec_send_packet(decoder, packet);
+				av_packet_unref(packet);
+				check(err, "MPEG-2 decoding failed");
+			} else {
+				check(avcodec_send_packet(decoder, NULL), "MPEG-2 decoding failed");
+			}
+			while (true) {
+				int err = avcodec_receive_frame(decoder, frame);
+				if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) return;
+				check(err, "MPEG-2 decoding failed");
+				if (!opened) openEncoder();
+				frame->pict_type = AV_PICTURE_TYPE_NONE;  // Let the encoder choose
+				encode(frame);
+				av_frame_unref(frame);
+			}
+		}
+		void finish() {
+			decode(NULL, 0);
+			if (!opened) throw TranscodeError("No video frames");
+			encode(NULL);
+			check(av_write_trailer(format), "Writing the video failed");
+		}
+	};
+}
+
+bool transcodeVideo(fs::path const& filename, VideoProducer const& producer, bool pal, VideoMetadata const& metadata, unsigned threads) {
+	Transcoder t(threads);
+	t.open(filename, pal, metadata);
+	producer([&t](char const* data, std::size_t size) { t.decode(data, size); });
+	t.finish();
+	return true;
+}
+#else
+bool transcodeVideo(fs::path const&, VideoProducer const&, bool, VideoMetadata const&, unsigned) { return false; }
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ipuconv.hh"
+
+#include <boost/filesystem/path.hpp>
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+namespace fs = boost::filesystem;
+
+// In-process video transcoding with libavcodec/libavformat.
+// Returns false without creating any file if support for it was not compiled in,
+// in which case the caller should write the MPEG video and use an external encoder.
+
+struct VideoMetadata {
+	std::string album, author, comment, title;
+};
+
+/// Produces the MPEG video by passing each picture to the given sink (e.g. by running IPUConv)
+typedef std::function<void (IPUSink const& sink)> VideoProducer;
+
+/// Thrown by transcodeVideo when libav fails, as opposed to errors of the producer that pass through
+struct TranscodeError: std::runtime_error {
+	explicit TranscodeError(std::string const& msg): std::runtime_error(msg) {}
+};
+
+/// Encode into H.264 (same settings as ffmpeg -vcodec libx264 -profile main -crf 20), in Matroska or MP4 by extension
+bool transcodeVideo(fs::path const& filename, VideoProducer const& producer, bool pal, VideoMetadata const& metadata, unsigned threads);